@@ -7,21 +7,22 @@
 #include "util.h"
 
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <unistd.h>
 
 using namespace node;
 using namespace v8;
 
 
-static int dbus_messages_iter_size(DBusMessageIter *iter) {
-  int msg_count = 0;
-  
-  while( dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INVALID) {
-    msg_count++;
-    dbus_message_iter_next(iter);
-  }
-  return msg_count;
-}
-
 static int dbus_messages_size(DBusMessage *message) {
   DBusMessageIter iter;
   int msg_count = 0;
@@ -41,6 +42,804 @@ static int dbus_messages_size(DBusMessage *message) {
   return msg_count; 
 }
 
+/**
+ * libdbus has no cheap way to ask for the size of a message, so every
+ * wrapped message reports this flat estimate to V8 as external memory.
+ */
+#define DBUS_MESSAGE_EXTERNAL_SIZE 1024
+
+/**
+ * Storage for exactly one fixed-width D-Bus value; get_basic and
+ * append_basic only touch as many bytes as the type is wide.
+ */
+union DBusFixedValue {
+	unsigned char y;
+	dbus_bool_t b;
+	dbus_int16_t n;
+	dbus_uint16_t q;
+	dbus_int32_t i;
+	dbus_uint32_t u;
+	dbus_int64_t x;
+	dbus_uint64_t t;
+	double d;
+	const char* s;
+	int fd;
+};
+
+static int dbus_fixed_type_size(int type) {
+  switch (type) {
+  case DBUS_TYPE_BYTE: return 1;
+  case DBUS_TYPE_INT16:
+  case DBUS_TYPE_UINT16: return 2;
+  case DBUS_TYPE_BOOLEAN:
+  case DBUS_TYPE_INT32:
+  case DBUS_TYPE_UINT32: return 4;
+  case DBUS_TYPE_INT64:
+  case DBUS_TYPE_UINT64:
+  case DBUS_TYPE_DOUBLE: return 8;
+  default: return 0;
+  }
+}
+
+static int dbus_message_marshalled_size(DBusMessage *message) {
+  char *blob = NULL;
+  int length = 0;
+
+  if (message == NULL || !dbus_message_marshal(message, &blob, &length))
+    return 0;
+  dbus_free(blob);
+  return length;
+}
+
+/**
+ * Appends every remaining argument under from to to, recursing into
+ * containers; used wherever messages are rebuilt natively. Arrays of
+ * fixed-width elements (ay, ai, ad, ...) are copied in one go.
+ */
+static bool dbus_messages_iter_copy(DBusMessageIter *from, DBusMessageIter *to) {
+  int type;
+
+  while ((type = dbus_message_iter_get_arg_type(from)) != DBUS_TYPE_INVALID) {
+    if (dbus_type_is_basic(type)) {
+      DBusFixedValue value;
+      bool ok;
+      dbus_message_iter_get_basic(from, &value);
+      ok = dbus_message_iter_append_basic(to, type, &value);
+      //Reading a file descriptor dups it and appending dups it again
+      if (type == DBUS_TYPE_UNIX_FD)
+        close(value.fd);
+      if (!ok)
+        return false;
+    }
+    else if (type == DBUS_TYPE_ARRAY && dbus_message_iter_get_element_type(from) != DBUS_TYPE_UNIX_FD && 
+      dbus_type_is_fixed(dbus_message_iter_get_element_type(from))) {
+      DBusMessageIter fromSub, toSub;
+      int element = dbus_message_iter_get_element_type(from), count;
+      char signature[2] = { (char) element, '\0' };
+      const void *elements;
+      bool ok;
+
+      dbus_message_iter_recurse(from, &fromSub);
+      dbus_message_iter_get_fixed_array(&fromSub, &elements, &count);
+      if (!dbus_message_iter_open_container(to, DBUS_TYPE_ARRAY, signature, &toSub))
+        return false;
+      //append_fixed_array wants the address of the pointer to the elements
+      ok = dbus_message_iter_append_fixed_array(&toSub, element, &elements, count);
+      if (!dbus_message_iter_close_container(to, &toSub) || !ok)
+        return false;
+    }
+    else {
+      DBusMessageIter fromSub, toSub;
+      char *signature = NULL;
+      bool ok;
+
+      dbus_message_iter_recurse(from, &fromSub);
+      //Variants and arrays need the signature of what they contain
+      if (type == DBUS_TYPE_VARIANT)
+        signature = dbus_message_iter_get_signature(&fromSub);
+      else if (type == DBUS_TYPE_ARRAY)
+        signature = dbus_message_iter_get_signature(from);
+
+      ok = dbus_message_iter_open_container(to, type, 
+        type == DBUS_TYPE_ARRAY ? signature + 1 : signature, &toSub);
+      dbus_free(signature);
+      if (!ok)
+        return false;
+      ok = dbus_messages_iter_copy(&fromSub, &toSub);
+      if (!dbus_message_iter_close_container(to, &toSub) || !ok)
+        return false;
+    }
+    dbus_message_iter_next(from);
+  }
+  return true;
+}
+
+/**
+ * True if all length bytes at data are 7-bit ASCII; checked a machine
+ * word at a time, with single bytes only for the tail.
+ */
+static bool dbus_is_ascii(const char *data, size_t length) {
+  const unsigned long high = ~0UL / 0xFF * 0x80;
+  unsigned long word;
+  size_t i = 0;
+
+  for (; i + sizeof(word) <= length; i += sizeof(word)) {
+    memcpy(&word, data + i, sizeof(word));
+    if (word & high)
+      return false;
+  }
+  for (; i < length; ++i)
+    if (data[i] & 0x80)
+      return false;
+  return true;
+}
+
+/**
+ * ASCII strings at least this long are handed to V8 as external strings
+ * pointing into the message instead of being copied. Below it the string
+ * is no bigger than the resource itself (object, message ref and the weak
+ * callback V8 runs when it goes), so copying costs less; most bus names,
+ * object paths and interface names are above it.
+ */
+#define DBUS_EXTERNAL_STRING_MIN 32
+
+/**
+ * DBusExternalString
+ * An ASCII string living in a message body; the message is kept alive by
+ * the string until V8 collects it.
+ */
+class DBusExternalString : public String::ExternalAsciiStringResource {
+public:
+  DBusExternalString(DBusMessage *m, const char *d, size_t l) : message(dbus_message_ref(m)), bytes(d), size(l) { };
+
+  ~DBusExternalString() {
+    dbus_message_unref(message);
+  };
+
+  const char* data() const {
+    return bytes;
+  };
+
+  size_t length() const {
+    return size;
+  };
+
+private:
+  DBusMessage *message;
+  const char *bytes;
+  size_t size;
+};
+
+/**
+ * Makes a string of length bytes of value: long ASCII strings from a
+ * locked message (owner) are not copied at all, everything else is copied
+ * with its length known; only non-ASCII data gets the full UTF-8 treatment.
+ * A message only has a serial once it has been sent or received, and
+ * from then on its body never changes under the string.
+ */
+static Handle<String> dbus_new_string(const char *value, size_t length, DBusMessage *owner) {
+  if (owner && dbus_message_get_serial(owner) != 0 && length >= DBUS_EXTERNAL_STRING_MIN && dbus_is_ascii(value, length))
+    return String::NewExternal(new DBusExternalString(owner, value, length));
+  return String::New(value, length);
+}
+
+/**
+ * DBusSnapshot
+ * A message body read into plain data, with no V8 involved, so it can be
+ * taken on a worker thread; the main thread only turns it into values.
+ * Variants are replaced by what they hold, fixed-width arrays keep their
+ * raw bytes in string with the element type in value.i.
+ */
+struct DBusSnapshot {
+  DBusSnapshot() : type(DBUS_TYPE_INVALID) { value.t = 0; };
+
+  //get_basic hands out a dup of every UNIX_FD, so each copy owns one of its own
+  DBusSnapshot(const DBusSnapshot& other) : type(other.type), value(other.value), string(other.string), children(other.children) {
+    if (type == DBUS_TYPE_UNIX_FD)
+      value.fd = dup(other.value.fd);
+  };
+
+  ~DBusSnapshot() {
+    if (type == DBUS_TYPE_UNIX_FD && value.fd >= 0)
+      close(value.fd);
+  };
+
+  DBusSnapshot& operator=(const DBusSnapshot& other) {
+    if (this == &other)
+      return *this;
+    if (type == DBUS_TYPE_UNIX_FD && value.fd >= 0)
+      close(value.fd);
+    type = other.type;
+    value = other.value;
+    string = other.string;
+    children = other.children;
+    if (type == DBUS_TYPE_UNIX_FD)
+      value.fd = dup(other.value.fd);
+    return *this;
+  };
+
+  int type;
+  DBusFixedValue value;
+  std::string string;
+  std::vector<DBusSnapshot> children;
+};
+
+static void dbus_snapshot_iter(DBusMessageIter *iter, std::vector<DBusSnapshot> &out) {
+  int type;
+
+  while ((type = dbus_message_iter_get_arg_type(iter)) != DBUS_TYPE_INVALID) {
+    DBusMessageIter sub;
+
+    if (type == DBUS_TYPE_VARIANT) {
+      dbus_message_iter_recurse(iter, &sub);
+      dbus_snapshot_iter(&sub, out);
+      dbus_message_iter_next(iter);
+      continue;
+    }
+
+    out.push_back(DBusSnapshot());
+    DBusSnapshot &item = out.back();
+    item.type = type;
+
+    if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_SIGNATURE) {
+      const char *value;
+      dbus_message_iter_get_basic(iter, &value);
+      item.string = value;
+    }
+    else if (dbus_type_is_basic(type)) {
+      dbus_message_iter_get_basic(iter, &item.value);
+    }
+    else if (type == DBUS_TYPE_ARRAY && dbus_fixed_type_size(dbus_message_iter_get_element_type(iter))) {
+      const char *data = NULL;
+      int length = 0;
+      item.value.i = dbus_message_iter_get_element_type(iter);
+      dbus_message_iter_recurse(iter, &sub);
+      dbus_message_iter_get_fixed_array(&sub, &data, &length);
+      item.string.assign(data ? data : "", length * dbus_fixed_type_size(item.value.i));
+    }
+    else {
+      dbus_message_iter_recurse(iter, &sub);
+      dbus_snapshot_iter(&sub, item.children);
+    }
+    dbus_message_iter_next(iter);
+  }
+}
+
+/**
+ * TraceEntry
+ * One traced call; all times are in nanoseconds from uv_hrtime(). The
+ * request and reply are held rather than measured, since marshalling a
+ * message is the only way to learn its size; that is left to drainTrace.
+ */
+struct TraceEntry {
+	TraceEntry() : serial(0), request(NULL), reply(NULL), start(0), sent(0), replied(0), decode(0) { };
+
+	TraceEntry(const TraceEntry& other) : request(NULL), reply(NULL) {
+		*this = other;
+	};
+
+	~TraceEntry() {
+		release();
+	};
+
+	TraceEntry& operator=(const TraceEntry& other) {
+		if (this == &other)
+			return *this;
+		release();
+		serial = other.serial;
+		destination = other.destination;
+		member = other.member;
+		request = other.request ? dbus_message_ref(other.request) : NULL;
+		reply = other.reply ? dbus_message_ref(other.reply) : NULL;
+		start = other.start;
+		sent = other.sent;
+		replied = other.replied;
+		decode = other.decode;
+		return *this;
+	};
+
+	void release() {
+		if (request)
+			dbus_message_unref(request);
+		if (reply)
+			dbus_message_unref(reply);
+		request = reply = NULL;
+	};
+
+	dbus_uint32_t serial;
+	std::string destination;
+	std::string member;
+	DBusMessage* request;
+	DBusMessage* reply;
+	uint64_t start;
+	uint64_t sent;
+	uint64_t replied;
+	uint64_t decode;
+};
+
+/**
+ * TraceRing
+ * Fixed-size ring of completed trace entries; the oldest entry is
+ * overwritten once the ring is full. Entries keep their messages alive
+ * until they are drained or overwritten.
+ */
+class TraceRing {
+public:
+	TraceRing(unsigned int c) : entries(new TraceEntry[c]), capacity(c), head(0), count(0), dropped(0) { };
+	~TraceRing() { delete[] entries; };
+
+	void push(const TraceEntry& entry) {
+		entries[(head + count) % capacity] = entry;
+		if (count < capacity) {
+			count++;
+		}
+		else {
+			head = (head + 1) % capacity;
+			dropped++;
+		}
+	};
+
+	TraceEntry* entries;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int dropped;
+};
+
+/**
+ * CodecStats
+ * Totals for one signature in one direction while the codec profiler is
+ * on; time is in nanoseconds, bytes is the marshalled message size and
+ * values counts the JS values built or read.
+ */
+struct CodecStats {
+	CodecStats() : count(0), time(0), bytes(0), values(0) { };
+
+	uint64_t count;
+	uint64_t time;
+	uint64_t bytes;
+	uint64_t values;
+};
+
+/**
+ * InternTable
+ * Maps name bytes to persistent symbol strings so the same interface,
+ * member, path and sender names are not re-created on every access.
+ * Open addressing with linear probing; the table stops accepting new
+ * names past INTERN_TABLE_LIMIT so unique names cannot grow it forever.
+ * Shared by a connection and every message it delivers, hence refcounted.
+ */
+#define INTERN_TABLE_LIMIT 4096
+
+class InternTable {
+public:
+	struct Slot {
+		Slot() : key(NULL), length(0), hash(0) { };
+		char* key;
+		size_t length;
+		uint32_t hash;
+		Persistent<String> value;
+	};
+
+	InternTable() : refs(1), size(0), capacity(64), slots(new Slot[64]) { };
+
+	~InternTable() {
+		for (unsigned int i = 0; i < capacity; ++i) {
+			if (slots[i].key) {
+				free(slots[i].key);
+				slots[i].value.Dispose();
+			}
+		}
+		delete[] slots;
+	};
+
+	void ref() {
+		refs++;
+	};
+
+	void unref() {
+		if (--refs == 0)
+			delete this;
+	};
+
+	//Returns the interned string, interning it first if insert is set; misses come from owner if given
+	Handle<String> get(const char* name, bool insert, DBusMessage* owner = NULL) {
+		size_t length = strlen(name);
+		uint32_t h = hash(name, length);
+		unsigned int i = h & (capacity - 1);
+
+		while (slots[i].key) {
+			if (slots[i].hash == h && slots[i].length == length && memcmp(slots[i].key, name, length) == 0)
+				return slots[i].value;
+			i = (i + 1) & (capacity - 1);
+		}
+
+		if (!insert || size >= INTERN_TABLE_LIMIT)
+			return dbus_new_string(name, length, owner);
+
+		slots[i].key = static_cast<char*>(malloc(length));
+		memcpy(slots[i].key, name, length);
+		slots[i].length = length;
+		slots[i].hash = h;
+		slots[i].value = Persistent<String>::New(String::NewSymbol(name, length));
+		Handle<String> result = slots[i].value;
+
+		if (++size * 2 > capacity)
+			grow();
+		return result;
+	};
+
+private:
+	static uint32_t hash(const char* data, size_t length) {
+		//FNV-1a
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < length; ++i) {
+			h ^= static_cast<unsigned char>(data[i]);
+			h *= 16777619u;
+		}
+		return h;
+	};
+
+	void grow() {
+		Slot* old = slots;
+		unsigned int oldCapacity = capacity;
+
+		capacity *= 2;
+		slots = new Slot[capacity];
+		for (unsigned int i = 0; i < oldCapacity; ++i) {
+			if (!old[i].key)
+				continue;
+			unsigned int j = old[i].hash & (capacity - 1);
+			while (slots[j].key)
+				j = (j + 1) & (capacity - 1);
+			slots[j] = old[i];
+		}
+		delete[] old;
+	};
+
+	unsigned int refs;
+	unsigned int size;
+	unsigned int capacity;
+	Slot* slots;
+};
+
+/**
+ * SchemaNode
+ * One position of a bound signature. Structs carry an object template
+ * whose fields are declared up front, so every decoded value shares one
+ * hidden class; dicts carry their known keys (in fields), which are set
+ * first and in that order. GENERIC positions use the plain decoder.
+ */
+class SchemaNode {
+public:
+	enum Kind { GENERIC, BODY, STRUCT, ARRAY, DICT };
+
+	SchemaNode(Kind k) : kind(k) { };
+
+	~SchemaNode() {
+		for (size_t i = 0; i < children.size(); ++i)
+			delete children[i];
+		for (size_t i = 0; i < fields.size(); ++i)
+			fields[i].Dispose();
+		if (!templ.IsEmpty())
+			templ.Dispose();
+	};
+
+	SchemaNode* child(size_t i) const {
+		return i < children.size() ? children[i] : NULL;
+	};
+
+	Kind kind;
+	std::vector<SchemaNode*> children;
+	std::vector< Persistent<String> > fields;
+	Persistent<ObjectTemplate> templ;
+};
+
+/**
+ * DBusSchemaWrap
+ * A signature bound to field names, created with schema(signature, descriptor).
+ * The descriptor mirrors the signature: one entry per argument, arrays are
+ * transparent, a struct is described by an array of field names (or
+ * { name, fields } for nested shapes) and a dict by { keys, values }.
+ */
+class DBusSchemaWrap : ObjectWrap {
+public:
+	static Persistent<FunctionTemplate> constructorTemplate;
+
+	SchemaNode* root;
+	char* signature;
+
+	DBusSchemaWrap() : ObjectWrap(), root(NULL), signature(NULL) {
+
+	};
+
+	~DBusSchemaWrap() {
+		delete root;
+		free(signature);
+	};
+
+	static void Init(Handle<Object> target) {
+		Local<FunctionTemplate> t = FunctionTemplate::New(New);
+		constructorTemplate = Persistent<FunctionTemplate>::New(t);
+		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+		constructorTemplate->SetClassName(String::NewSymbol("DBusSchema"));
+		NODE_SET_METHOD(target, "schema", schema);
+		NODE_SET_GETTER(t, "signature", getSignature);
+	};
+
+	static Handle<Value> New(const Arguments &args) {
+		HandleScope scope;
+		DBusSchemaWrap* object = new DBusSchemaWrap();
+		object->Wrap(args.This());
+		return args.This();
+	};
+
+	static Handle<Value> at(Handle<Value> descriptor, uint32_t i) {
+		if (!descriptor->IsArray())
+			return Undefined();
+		return Local<Array>::Cast(descriptor)->Get(i);
+	};
+
+	static Handle<Value> property(Handle<Value> descriptor, const char* name) {
+		if (!descriptor->IsObject())
+			return Undefined();
+		return descriptor->ToObject()->Get(String::NewSymbol(name));
+	};
+
+	static SchemaNode* compile(DBusSignatureIter* siter, Handle<Value> descriptor) {
+		switch (dbus_signature_iter_get_current_type(siter)) {
+		case DBUS_TYPE_STRUCT: {
+			if (!descriptor->IsArray())
+				return new SchemaNode(SchemaNode::GENERIC);
+
+			SchemaNode* node = new SchemaNode(SchemaNode::STRUCT);
+			Local<ObjectTemplate> templ = ObjectTemplate::New();
+			DBusSignatureIter member;
+			uint32_t i = 0;
+
+			dbus_signature_iter_recurse(siter, &member);
+			do {
+				Handle<Value> field = at(descriptor, i++);
+				Handle<Value> name = field->IsString() ? field : property(field, "name");
+				if (!name->IsString()) {
+					delete node;
+					return NULL;
+				}
+				Local<String> symbol = String::NewSymbol(*String::Utf8Value(name));
+				node->fields.push_back(Persistent<String>::New(symbol));
+				node->children.push_back(compile(&member, property(field, "fields")));
+				templ->Set(symbol, Undefined());
+				if (!node->children.back()) {
+					delete node;
+					return NULL;
+				}
+			} while (dbus_signature_iter_next(&member));
+
+			node->templ = Persistent<ObjectTemplate>::New(templ);
+			return node;
+		}
+		case DBUS_TYPE_ARRAY: {
+			DBusSignatureIter element;
+			SchemaNode* node;
+
+			dbus_signature_iter_recurse(siter, &element);
+			if (dbus_signature_iter_get_current_type(&element) == DBUS_TYPE_DICT_ENTRY) {
+				Handle<Value> keys = property(descriptor, "keys");
+				DBusSignatureIter entry;
+
+				node = new SchemaNode(SchemaNode::DICT);
+				//Keys are not declared on a template: one the message lacks must stay absent
+				if (keys->IsArray()) {
+					for (uint32_t i = 0; i < Local<Array>::Cast(keys)->Length(); ++i)
+						node->fields.push_back(Persistent<String>::New(String::NewSymbol(*String::Utf8Value(at(keys, i)))));
+				}
+				dbus_signature_iter_recurse(&element, &entry);
+				dbus_signature_iter_next(&entry);
+				node->children.push_back(compile(&entry, property(descriptor, "values")));
+			}
+			else {
+				node = new SchemaNode(SchemaNode::ARRAY);
+				node->children.push_back(compile(&element, descriptor));
+			}
+
+			if (!node->children.back()) {
+				delete node;
+				return NULL;
+			}
+			return node;
+		}
+		default:
+			return new SchemaNode(SchemaNode::GENERIC);
+		}
+	};
+
+	static Handle<Value> schema(const Arguments& args) {
+		HandleScope scope;
+		REQ_STR_ARG(0, signature);
+		Handle<Value> descriptor = args.Length() > 1 ? args[1] : Handle<Value>(Undefined());
+		DBusError error;
+		DBusSignatureIter siter;
+		
+		dbus_error_init(&error);
+		if (!dbus_signature_validate(signature, &error)) {
+			Local<Value> exception = Exception::TypeError(String::New(error.message));
+			dbus_error_free(&error);
+			return ThrowException(exception);
+		}
+
+		SchemaNode* root = new SchemaNode(SchemaNode::BODY);
+		if (signature[0] != '\0') {
+			uint32_t i = 0;
+			dbus_signature_iter_init(&siter, signature);
+			do {
+				SchemaNode* child = compile(&siter, at(descriptor, i++));
+				if (!child) {
+					delete root;
+					THROW_ERROR(TypeError, "Every struct field in a schema needs a name!");
+				}
+				root->children.push_back(child);
+			} while (dbus_signature_iter_next(&siter));
+		}
+
+		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+		DBusSchemaWrap* wrap = ObjectWrap::Unwrap<DBusSchemaWrap>(object);
+		wrap->root = root;
+		wrap->signature = strdup(signature);
+		return scope.Close(object);
+	};
+
+	static Handle<Value> getSignature(Local<String> property, const AccessorInfo& info) {
+		return String::New(ObjectWrap::Unwrap<DBusSchemaWrap>(info.This())->signature);
+	};
+};
+Persistent<FunctionTemplate> DBusSchemaWrap::constructorTemplate;
+
+/**
+ * DBusBlobWrap
+ * Values encoded once against a signature, created with blob(signature,
+ * values). Passed as an argument (or as all of a message's arguments) the
+ * already marshalled body is copied across natively instead of walking
+ * the JavaScript values again.
+ */
+class DBusBlobWrap : ObjectWrap {
+public:
+	static Persistent<FunctionTemplate> constructorTemplate;
+
+	DBusMessage* body;
+	char* signature;
+	int size;
+
+	DBusBlobWrap() : ObjectWrap(), body(NULL), signature(NULL), size(0) {
+
+	};
+
+	~DBusBlobWrap() {
+		if (body) {
+			dbus_message_unref(body);
+			V8::AdjustAmountOfExternalAllocatedMemory(-size);
+		}
+		free(signature);
+	};
+
+	static void Init(Handle<Object> target) {
+		Local<FunctionTemplate> t = FunctionTemplate::New(New);
+		constructorTemplate = Persistent<FunctionTemplate>::New(t);
+		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+		constructorTemplate->SetClassName(String::NewSymbol("DBusBlob"));
+		NODE_SET_GETTER(t, "signature", getSignature);
+		NODE_SET_GETTER(t, "size", getSize);
+	};
+
+	static Handle<Value> New(const Arguments &args) {
+		HandleScope scope;
+		DBusBlobWrap* object = new DBusBlobWrap();
+		object->Wrap(args.This());
+		return args.This();
+	};
+
+	static bool is(Handle<Value> value) {
+		return value->IsObject() && constructorTemplate->HasInstance(value);
+	};
+
+	static DBusBlobWrap* of(Handle<Value> value) {
+		return ObjectWrap::Unwrap<DBusBlobWrap>(value->ToObject());
+	};
+
+	//Takes over body; size is what it marshals to
+	static Handle<Value> finalizeBlob(DBusMessage* body, const char* signature) {
+		HandleScope scope;
+		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+		DBusBlobWrap* wrap = ObjectWrap::Unwrap<DBusBlobWrap>(object);
+		wrap->body = body;
+		wrap->signature = strdup(signature);
+		wrap->size = dbus_message_marshalled_size(body);
+		V8::AdjustAmountOfExternalAllocatedMemory(wrap->size);
+		return scope.Close(object);
+	};
+
+	static Handle<Value> getSignature(Local<String> property, const AccessorInfo& info) {
+		return String::New(ObjectWrap::Unwrap<DBusBlobWrap>(info.This())->signature);
+	};
+
+	static Handle<Value> getSize(Local<String> property, const AccessorInfo& info) {
+		return Integer::New(ObjectWrap::Unwrap<DBusBlobWrap>(info.This())->size);
+	};
+};
+Persistent<FunctionTemplate> DBusBlobWrap::constructorTemplate;
+
+/**
+ * DBusVariantWrap
+ * A value tagged with the signature it should travel as inside a variant,
+ * created with variant(signature, value); it saves guessing the type
+ * from the value and can say what guessing cannot (bytes, 64-bit, ...).
+ */
+class DBusVariantWrap : ObjectWrap {
+public:
+	static Persistent<FunctionTemplate> constructorTemplate;
+
+	Persistent<Value> value;
+	char* signature;
+
+	DBusVariantWrap() : ObjectWrap(), signature(NULL) {
+
+	};
+
+	~DBusVariantWrap() {
+		if (!value.IsEmpty())
+			value.Dispose();
+		free(signature);
+	};
+
+	static void Init(Handle<Object> target) {
+		Local<FunctionTemplate> t = FunctionTemplate::New(New);
+		constructorTemplate = Persistent<FunctionTemplate>::New(t);
+		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+		constructorTemplate->SetClassName(String::NewSymbol("DBusVariant"));
+		NODE_SET_METHOD(target, "variant", variant);
+		NODE_SET_GETTER(t, "signature", getSignature);
+		NODE_SET_GETTER(t, "value", getValue);
+	};
+
+	static Handle<Value> New(const Arguments &args) {
+		HandleScope scope;
+		DBusVariantWrap* object = new DBusVariantWrap();
+		object->Wrap(args.This());
+		return args.This();
+	};
+
+	static bool is(Handle<Value> value) {
+		return value->IsObject() && constructorTemplate->HasInstance(value);
+	};
+
+	static DBusVariantWrap* of(Handle<Value> value) {
+		return ObjectWrap::Unwrap<DBusVariantWrap>(value->ToObject());
+	};
+
+	static Handle<Value> variant(const Arguments &args) {
+		REQ_STR_ARG(0, signature);
+		REQ_ARGS(2);
+		HandleScope scope;
+
+		if (!dbus_signature_validate_single(signature, NULL))
+			THROW_ERROR(TypeError, "A variant holds exactly one complete type!");
+
+		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+		DBusVariantWrap* wrap = ObjectWrap::Unwrap<DBusVariantWrap>(object);
+		wrap->value = Persistent<Value>::New(args[1]);
+		wrap->signature = strdup(signature);
+		return scope.Close(object);
+	};
+
+	static Handle<Value> getSignature(Local<String> property, const AccessorInfo& info) {
+		return String::New(ObjectWrap::Unwrap<DBusVariantWrap>(info.This())->signature);
+	};
+
+	static Handle<Value> getValue(Local<String> property, const AccessorInfo& info) {
+		return ObjectWrap::Unwrap<DBusVariantWrap>(info.This())->value;
+	};
+};
+Persistent<FunctionTemplate> DBusVariantWrap::constructorTemplate;
+
 
 class DBusMessageWrap : ObjectWrap {
 public:
@@ -48,13 +847,79 @@ public:
 	
 	DBusMessage* message;
 	const char * signature;
+	TraceEntry* trace;
+	InternTable* names;
+	Persistent<Object> schema;
+	DBusMessage* prototype;
+
+	/**
+	 * Native wrappers freed by the GC are kept here and handed out again
+	 * for the next one, so steady traffic does not go to the allocator.
+	 * Only the native side is pooled: every message gets a JS object of
+	 * its own, so a handle kept past dispose() stays disposed.
+	 */
+	static std::vector<void*> pool;
+	static size_t poolSize;
+
+	static void* operator new(size_t size) {
+		if (size != sizeof(DBusMessageWrap) || pool.empty())
+			return ::operator new(size);
+		void* memory = pool.back();
+		pool.pop_back();
+		return memory;
+	};
+
+	static void operator delete(void* memory, size_t size) {
+		if (size == sizeof(DBusMessageWrap) && pool.size() < poolSize)
+			pool.push_back(memory);
+		else
+			::operator delete(memory);
+	};
 
-	DBusMessageWrap() : ObjectWrap(), message(NULL), signature(NULL) {
+	DBusMessageWrap() : ObjectWrap(), message(NULL), signature(NULL), trace(NULL), names(NULL), prototype(NULL) {
 
 	};
 
 	~DBusMessageWrap() {
+		reset();
+	};
+
+	//Returns the wrapper to the state New() left it in
+	void reset() {
+		release();
+		free(const_cast<char*>(signature));
+		signature = NULL;
+		trace = NULL;
+		if (names)
+			names->unref();
+		names = NULL;
+		if (!schema.IsEmpty())
+			schema.Dispose();
+		schema.Clear();
+		if (prototype)
+			dbus_message_unref(prototype);
+		prototype = NULL;
+	};
+
+	SchemaNode* schemaRoot() const {
+		if (schema.IsEmpty())
+			return NULL;
+		return ObjectWrap::Unwrap<DBusSchemaWrap>(schema)->root;
+	};
+
+	void release() {
+		if (message == NULL)
+			return;
 		dbus_message_unref(message);
+		message = NULL;
+		V8::AdjustAmountOfExternalAllocatedMemory(-DBUS_MESSAGE_EXTERNAL_SIZE);
+	};
+
+	static DBusMessage* live(const AccessorInfo& info) {
+		DBusMessage* message = THIS_MESSAGE(info)->message;
+		if (message == NULL)
+			ThrowException(Exception::Error(String::New("Message has been disposed!")));
+		return message;
 	};
 
 	operator DBusMessage* () const {
@@ -71,12 +936,23 @@ public:
 		NODE_SET_METHOD(target, "methodReturn", methodReturn);
 		NODE_SET_METHOD(target, "signal", signal);
 		NODE_SET_METHOD(target, "error", error);
+		NODE_SET_METHOD(target, "blob", blob);
+
+		NODE_SET_METHOD(target, "setMessagePoolSize", setMessagePoolSize);
+		NODE_SET_METHOD(target, "setProfiling", setProfiling);
+		NODE_SET_METHOD(target, "profile", profile);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "dispose", dispose);
+		NODE_SET_PROTOTYPE_METHOD(t, "fill", fill);
 
 		NODE_SET_GETTER(t, "serial", serial);
 		NODE_SET_GETTER(t, "type", type);
 		NODE_SET_GETTER(t, "path", path);
+		NODE_SET_GETTER(t, "sender", sender);
+		NODE_SET_GETTER(t, "destination", destination);
 		NODE_SET_GETTER_SETTER(t, "arguments", getArguments, setArguments);
 		NODE_SET_GETTER_SETTER(t, "signature", getSignature, setSignature);
+		NODE_SET_GETTER_SETTER(t, "schema", getSchema, setSchema);
 		NODE_SET_GETTER_SETTER(t, "error", getErrorName, setErrorName);
 
 		NODE_SET_GETTER_SETTER(t, "interface", getInterface, setInterface);
@@ -90,21 +966,158 @@ public:
 		return args.This();
 	};
 
-	static Handle<Value> finalizeMessage(DBusMessage* message) {
+	static Handle<Value> finalizeMessage(DBusMessage* message, InternTable* names = NULL) {
 		HandleScope scope;
 		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+
 		DBusMessageWrap *wrap = ObjectWrap::Unwrap<DBusMessageWrap>(object);
 		wrap->message = message;
+		wrap->names = names;
+		if (names)
+			names->ref();
+		if (message)
+			V8::AdjustAmountOfExternalAllocatedMemory(DBUS_MESSAGE_EXTERNAL_SIZE);
 		return scope.Close(object);
 	};
 
-	static Handle<Value> methodCall(const Arguments& args) {
-		REQ_STR_ARG(0, destination);
-		REQ_STR_ARG(1, path);
-		REQ_STR_ARG(2, interface);
-		REQ_STR_ARG(3, method);
-		return finalizeMessage(dbus_message_new_method_call(destination, path, interface, method));
-	};
+	/**
+	 * Drops the message right away; the object stays disposed and its
+	 * accessors throw from then on.
+	 */
+	static Handle<Value> dispose(const Arguments& args) {
+		DBusMessageWrap* wrap = THIS_MESSAGE(args);
+		if (!wrap->message)
+			return Undefined();
+		wrap->reset();
+		return Undefined();
+	};
+
+	static Handle<Value> setMessagePoolSize(const Arguments& args) {
+		REQ_INT_ARG(0, size);
+		if (size < 0)
+			THROW_ERROR(RangeError, "Pool size must not be negative!");
+		poolSize = size;
+		while (pool.size() > poolSize) {
+			::operator delete(pool.back());
+			pool.pop_back();
+		}
+		return Undefined();
+	};
+
+	//Turning the profiler on starts it over from empty totals
+	static Handle<Value> setProfiling(const Arguments& args) {
+		REQ_BOOL_ARG(0, enabled);
+		if (enabled && !profiling) {
+			decodeProfile.clear();
+			encodeProfile.clear();
+		}
+		profiling = enabled;
+		return Undefined();
+	};
+
+	typedef std::pair<const char*, std::map<std::string, CodecStats>::const_iterator> ProfileRow;
+
+	static bool slower(const ProfileRow& a, const ProfileRow& b) {
+		return a.second->second.time > b.second->second.time;
+	};
+
+	static void collect(std::vector<ProfileRow>& rows, const std::map<std::string, CodecStats>& profile, const char* direction) {
+		for (std::map<std::string, CodecStats>::const_iterator it = profile.begin(); it != profile.end(); ++it)
+			rows.push_back(ProfileRow(direction, it));
+	};
+
+	/**
+	 * Profiler totals as an array of rows, slowest signature first; a
+	 * true argument clears the totals once they are read.
+	 */
+	static Handle<Value> profile(const Arguments& args) {
+		HandleScope scope;
+		std::vector<ProfileRow> rows;
+
+		collect(rows, decodeProfile, "decode");
+		collect(rows, encodeProfile, "encode");
+		std::stable_sort(rows.begin(), rows.end(), slower);
+
+		Local<Array> result = Array::New(rows.size());
+		for (size_t i = 0; i < rows.size(); ++i) {
+			const std::string& signature = rows[i].second->first;
+			const CodecStats& stats = rows[i].second->second;
+			Local<Object> row = Object::New();
+			row->Set(String::NewSymbol("signature"), String::New(signature.data(), signature.length()));
+			row->Set(String::NewSymbol("direction"), String::NewSymbol(rows[i].first));
+			row->Set(String::NewSymbol("count"), Number::New(static_cast<double>(stats.count)));
+			row->Set(String::NewSymbol("time"), Number::New(static_cast<double>(stats.time)));
+			row->Set(String::NewSymbol("bytes"), Number::New(static_cast<double>(stats.bytes)));
+			row->Set(String::NewSymbol("values"), Number::New(static_cast<double>(stats.values)));
+			result->Set(i, row);
+		}
+
+		if (args.Length() > 0 && args[0]->BooleanValue()) {
+			decodeProfile.clear();
+			encodeProfile.clear();
+		}
+		return scope.Close(result);
+	};
+
+	//A body-less copy of the header, for messages that can be sent again
+	static DBusMessage* headerOf(DBusMessage* message) {
+		DBusMessage* copy = NULL;
+
+		switch (dbus_message_get_type(message)) {
+		case DBUS_MESSAGE_TYPE_METHOD_CALL:
+			copy = dbus_message_new_method_call(dbus_message_get_destination(message), dbus_message_get_path(message), 
+				dbus_message_get_interface(message), dbus_message_get_member(message));
+			break;
+		case DBUS_MESSAGE_TYPE_SIGNAL:
+			copy = dbus_message_new_signal(dbus_message_get_path(message), dbus_message_get_interface(message), dbus_message_get_member(message));
+			if (copy && dbus_message_get_destination(message))
+				dbus_message_set_destination(copy, dbus_message_get_destination(message));
+			break;
+		default:
+			//Replies and errors belong to exactly one call
+			return NULL;
+		}
+
+		if (copy) {
+			dbus_message_set_no_reply(copy, dbus_message_get_no_reply(message));
+			dbus_message_set_auto_start(copy, dbus_message_get_auto_start(message));
+		}
+		return copy;
+	};
+
+	/**
+	 * Swaps in a fresh copy of this message's header and encodes args (if
+	 * given) with the current signature. The header is captured on first
+	 * use, so a method call or signal can be refilled and sent repeatedly
+	 * with only its arguments re-encoded.
+	 */
+	static Handle<Value> fill(const Arguments& args) {
+		DBusMessageWrap* wrap = THIS_MESSAGE(args);
+		
+		if (!wrap->message)
+			THROW_ERROR(Error, "Message has been disposed!");
+
+		if (!wrap->prototype && !(wrap->prototype = headerOf(wrap->message)))
+			THROW_ERROR(TypeError, "Only method calls and signals can be refilled!");
+
+		DBusMessage* message = dbus_message_copy(wrap->prototype);
+		if (!message)
+			THROW_ERROR(Error, "Out of memory!");
+		dbus_message_unref(wrap->message);
+		wrap->message = message;
+
+		if (args.Length() > 0)
+			appendArguments(wrap, args[0]);
+		return args.This();
+	};
+
+	static Handle<Value> methodCall(const Arguments& args) {
+		REQ_STR_ARG(0, destination);
+		REQ_STR_ARG(1, path);
+		REQ_STR_ARG(2, interface);
+		REQ_STR_ARG(3, method);
+		return finalizeMessage(dbus_message_new_method_call(destination, path, interface, method));
+	};
 
 	static Handle<Value> methodReturn(const Arguments& args) {
 		REQ_MSG_ARG(0, origin);
@@ -124,18 +1137,80 @@ public:
 		REQ_STR_ARG(2, message);
 		return finalizeMessage(dbus_message_new_error(*origin, name, message));
 	};
+
+	//Encodes values (one per complete type of signature) into a reusable blob
+	static Handle<Value> blob(const Arguments& args) {
+		REQ_STR_ARG(0, signature);
+		REQ_OBJ_ARG(1, list);
+		DBusMessageIter iter;
+		DBusSignatureIter siter;
+		uint32_t count = 0;
+		uint64_t start = profiling ? uv_hrtime() : 0;
+		uint64_t counted = values;
+
+		if (signature[0] == '\0' || !dbus_signature_validate(signature, NULL))
+			THROW_ERROR(TypeError, "Invalid signature!");
+
+		//Only the body of this message is ever used
+		DBusMessage* body = dbus_message_new(DBUS_MESSAGE_TYPE_SIGNAL);
+		if (!body)
+			THROW_ERROR(Error, "Out of memory!");
+
+		dbus_signature_iter_init(&siter, signature);
+		dbus_message_iter_init_append(body, &iter);
+		do {
+			char* sig = dbus_signature_iter_get_signature(&siter);
+			bool ok = encode(values->Get(count++), &iter, sig);
+			dbus_free(sig);
+			if (!ok) {
+				dbus_message_unref(body);
+				THROW_ERROR(TypeError, "Values do not match the signature!");
+			}
+		} while (dbus_signature_iter_next(&siter));
+
+		if (profiling)
+			record(encodeProfile, signature, start, counted, body);
+		return DBusBlobWrap::finalizeBlob(body, signature);
+	};
  
 
 	static Handle<Value> serial(Local<String> property, const AccessorInfo& info) {
-		return Integer::New(dbus_message_get_serial(*THIS_MESSAGE(info)));
+		DBusMessage* message = live(info);
+		if (!message)
+			return Undefined();
+		return Integer::NewFromUnsigned(dbus_message_get_serial(message));
 	};
 
 	static Handle<Value> type(Local<String> property, const AccessorInfo& info) {
-		return Integer::New(dbus_message_get_type(*THIS_MESSAGE(info)));
+		DBusMessage* message = live(info);
+		if (!message)
+			return Undefined();
+		return Integer::New(dbus_message_get_type(message));
+	};
+
+	//Header names come from the connection's intern table when there is one
+	static Handle<Value> name(const AccessorInfo& info, const char* value) {
+		if (!value)
+			return Undefined();
+		InternTable* names = THIS_MESSAGE(info)->names;
+		if (names)
+			return names->get(value, true);
+		return String::New(value);
 	};
 
 	static Handle<Value> path(Local<String> property, const AccessorInfo& info) {
-		return String::New(dbus_message_get_path(*THIS_MESSAGE(info)));
+		DBusMessage* message = live(info);
+		return name(info, message ? dbus_message_get_path(message) : NULL);
+	};
+
+	static Handle<Value> sender(Local<String> property, const AccessorInfo& info) {
+		DBusMessage* message = live(info);
+		return name(info, message ? dbus_message_get_sender(message) : NULL);
+	};
+
+	static Handle<Value> destination(Local<String> property, const AccessorInfo& info) {
+		DBusMessage* message = live(info);
+		return name(info, message ? dbus_message_get_destination(message) : NULL);
 	};
 
 	static Handle<Value> decodeBoolean(DBusMessageIter *iter) {
@@ -144,10 +1219,97 @@ public:
 		return Boolean::New(value);	
 	};
 
+	//64-bit values do not all fit a double, so every one of them comes back as a decimal string
+	static Handle<Value> decodeInt64(dbus_int64_t value) {
+		char buffer[24];
+		snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+		return String::New(buffer);
+	};
+
+	static Handle<Value> decodeUint64(dbus_uint64_t value) {
+		char buffer[24];
+		snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+		return String::New(buffer);
+	};
+
+	//Converts one fixed-width value of the given type read from data
+	static Handle<Value> decodeFixed(int type, const void* data) {
+		const DBusFixedValue* value = static_cast<const DBusFixedValue*>(data);
+		switch (type) {
+		case DBUS_TYPE_BYTE: return Integer::NewFromUnsigned(value->y);
+		case DBUS_TYPE_BOOLEAN: return Boolean::New(value->b);
+		case DBUS_TYPE_INT16: return Integer::New(value->n);
+		case DBUS_TYPE_UINT16: return Integer::NewFromUnsigned(value->q);
+		case DBUS_TYPE_INT32: return Integer::New(value->i);
+		case DBUS_TYPE_UINT32: return Integer::NewFromUnsigned(value->u);
+		case DBUS_TYPE_INT64: return decodeInt64(value->x);
+		case DBUS_TYPE_UINT64: return decodeUint64(value->t);
+		case DBUS_TYPE_DOUBLE: return Number::New(value->d);
+		default: return Undefined();
+		}
+	};
+
 	static Handle<Value> decodeInteger(DBusMessageIter *iter) {
-		dbus_uint64_t value = 0; 
+		DBusFixedValue value;
+		int type = dbus_message_iter_get_arg_type(iter);
 		dbus_message_iter_get_basic(iter, &value);
-		return Integer::New(value);
+		return decodeFixed(type, &value);
+	};
+
+	//Arrays of fixed-width types are read in one block instead of element by element
+	static Handle<Value> decodeFixedArray(DBusMessageIter *iter) {
+		DBusMessageIter sub;
+		const char* data = NULL;
+		int length = 0;
+		int type = dbus_message_iter_get_element_type(iter);
+		int size = dbus_fixed_type_size(type);
+
+		dbus_message_iter_recurse(iter, &sub);
+		dbus_message_iter_get_fixed_array(&sub, &data, &length);
+
+		if (profiling)
+			values += length;
+		Local<Array> result = Array::New(length);
+		for (int i = 0; i < length; ++i)
+			result->Set(i, decodeFixed(type, data + i * size));
+		return result;
+	};
+
+	//Builds the values of a snapshot the same way decode would have
+	static Handle<Value> materialize(const DBusSnapshot& item) {
+		switch (item.type) {
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE:
+			return String::New(item.string.data(), item.string.length());
+
+		case DBUS_TYPE_ARRAY:
+			if (item.children.empty() && dbus_fixed_type_size(item.value.i)) {
+				int size = dbus_fixed_type_size(item.value.i), length = item.string.length() / size;
+				Local<Array> result = Array::New(length);
+				for (int i = 0; i < length; ++i)
+					result->Set(i, decodeFixed(item.value.i, item.string.data() + i * size));
+				return result;
+			}
+			//fall through
+		case DBUS_TYPE_STRUCT: {
+			Local<Array> result = Array::New();
+			int count = 0;
+			for (size_t i = 0; i < item.children.size(); ++i) {
+				const DBusSnapshot& child = item.children[i];
+				if (child.type == DBUS_TYPE_DICT_ENTRY && child.children.size() == 2)
+					result->Set(materialize(child.children[0]), materialize(child.children[1]));
+				else
+					result->Set(count++, materialize(child));
+			}
+			return result;
+		}
+
+		default:
+			if (dbus_fixed_type_size(item.type))
+				return decodeFixed(item.type, &item.value);
+			return Undefined();
+		}
 	};
 
 	static Handle<Value> decodeDouble(DBusMessageIter *iter) {
@@ -156,13 +1318,54 @@ public:
 		return Number::New(value);
 	}
 
-	static Handle<Value> decodeString(DBusMessageIter *iter) {
+	/**
+	 * The message whose body is being decoded, if strings may point into
+	 * it; set for the duration of a decode with a DecodingScope.
+	 */
+	static DBusMessage* decoding;
+
+	/**
+	 * Codec profiler: while profiling is on, every body decoded or encoded
+	 * adds to the totals of its signature. values is bumped by the codec
+	 * itself for each JS value it builds or reads, only while profiling.
+	 */
+	static bool profiling;
+	static uint64_t values;
+	static std::map<std::string, CodecStats> decodeProfile;
+	static std::map<std::string, CodecStats> encodeProfile;
+
+	static void record(std::map<std::string, CodecStats>& profile, const char* signature, uint64_t start, uint64_t counted, DBusMessage* message) {
+		CodecStats& stats = profile[signature ? signature : ""];
+		stats.time += uv_hrtime() - start;
+		stats.count++;
+		stats.values += values - counted;
+		stats.bytes += dbus_message_marshalled_size(message);
+	};
+
+	class DecodingScope {
+	public:
+		DecodingScope(DBusMessage* message) : previous(decoding) {
+			decoding = message;
+		};
+		~DecodingScope() {
+			decoding = previous;
+		};
+	private:
+		DBusMessage* previous;
+	};
+
+	static Handle<Value> decodeString(DBusMessageIter *iter, InternTable* names) {
 		const char *value;
 		dbus_message_iter_get_basic(iter, &value); 
-		return String::New(value);
+		//Object paths are names; plain strings only reuse names seen before
+		if (names)
+			return names->get(value, dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_OBJECT_PATH, decoding);
+		return dbus_new_string(value, strlen(value), decoding);
 	}
 
-	static Handle<Value> decode(DBusMessageIter *iter) {
+	static Handle<Value> decode(DBusMessageIter *iter, InternTable* names = NULL) {
+		if (profiling)
+			values++;
 		switch (dbus_message_iter_get_arg_type(iter)) {
 		
 		case DBUS_TYPE_BOOLEAN: 
@@ -183,44 +1386,44 @@ public:
 		case DBUS_TYPE_OBJECT_PATH:
 		case DBUS_TYPE_SIGNATURE:
 		case DBUS_TYPE_STRING: 
-			return decodeString(iter);
+			return decodeString(iter, names);
 		
 		case DBUS_TYPE_ARRAY:
+			if (dbus_fixed_type_size(dbus_message_iter_get_element_type(iter)))
+				return decodeFixedArray(iter);
+			//fall through
 		case DBUS_TYPE_STRUCT:
 		{
-			DBusMessageIter internal_iter, internal_temp_iter;
+			DBusMessageIter internal_iter;
 			int count = 0;         
 
-			//count the size of the array
-			dbus_message_iter_recurse(iter, &internal_temp_iter);
-			count = dbus_messages_iter_size(&internal_temp_iter);
-
-			//create the result object
-			Local<Array> resultArray = Array::New(count);
-			count = 0;
+			//create the result object; it grows as elements are decoded
+			//rather than walking the whole container twice
+			Local<Array> resultArray = Array::New();
 			dbus_message_iter_recurse(iter, &internal_iter);
 
-			do {
+			while (dbus_message_iter_get_arg_type(&internal_iter) != DBUS_TYPE_INVALID) {
 				//this is dict entry
 				if (dbus_message_iter_get_arg_type(&internal_iter)  == DBUS_TYPE_DICT_ENTRY) {
 					//Item is dict entry, it is exactly key-value pair
 					DBusMessageIter dict_entry_iter;
 					//The key 
 					dbus_message_iter_recurse(&internal_iter, &dict_entry_iter);
-					Handle<Value> key  = decode(&dict_entry_iter);
+					Handle<Value> key  = decode(&dict_entry_iter, names);
 					//The value
 					dbus_message_iter_next(&dict_entry_iter);
-					Handle<Value> value = decode(&dict_entry_iter);
+					Handle<Value> value = decode(&dict_entry_iter, names);
 					//set the property
 					resultArray->Set(key, value); 
 				} 
 				else {
 					//Item is array
-					Handle<Value> itemValue = decode(&internal_iter);
+					Handle<Value> itemValue = decode(&internal_iter, names);
 					resultArray->Set(count, itemValue);
 					count++;
 				}
-			} while(dbus_message_iter_next(&internal_iter));
+				dbus_message_iter_next(&internal_iter);
+			}
 			//return the array object
 			return resultArray;
 		}
@@ -228,7 +1431,7 @@ public:
 		case DBUS_TYPE_VARIANT: { 
 			DBusMessageIter internal_iter;
 			dbus_message_iter_recurse(iter, &internal_iter);
-			Handle<Value> result = decode(&internal_iter);
+			Handle<Value> result = decode(&internal_iter, names);
 			return result;
 		}
 			
@@ -241,23 +1444,185 @@ public:
 		}
 	}
 
-	static char* signatureFromValue(Local<Value>& value) {
-		if (value->IsTrue() || value->IsFalse() || value->IsBoolean() ) {
-			return const_cast<char*>(DBUS_TYPE_BOOLEAN_AS_STRING);
-		} else if (value->IsInt32()) {
-			return const_cast<char*>(DBUS_TYPE_INT32_AS_STRING);
-		} else if (value->IsUint32()) {
-			return const_cast<char*>(DBUS_TYPE_UINT32_AS_STRING);
-		} else if (value->IsNumber()) {
-			return const_cast<char*>(DBUS_TYPE_DOUBLE_AS_STRING);
-		} else if (value->IsString()) {
-			return const_cast<char*>(DBUS_TYPE_STRING_AS_STRING);
-		} else if (value->IsArray()) {
-			return const_cast<char*>(DBUS_TYPE_ARRAY_AS_STRING);
-		} else if (value->IsObject()) {
-			return const_cast<char*>(DBUS_TYPE_STRUCT_AS_STRING);
-		} else {
-			return NULL;
+	//Decodes along a schema, falling back to decode() wherever the message disagrees with it
+	static Handle<Value> decodeShaped(DBusMessageIter *iter, InternTable* names, SchemaNode* node) {
+		int type = dbus_message_iter_get_arg_type(iter);
+		DBusMessageIter sub;
+
+		if (!node || node->kind == SchemaNode::GENERIC)
+			return decode(iter, names);
+
+		if (node->kind == SchemaNode::STRUCT && type == DBUS_TYPE_STRUCT) {
+			size_t members = 0;
+			//A struct with more or fewer members than the schema names is decoded unshaped
+			dbus_message_iter_recurse(iter, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+				members++;
+				dbus_message_iter_next(&sub);
+			}
+			if (members != node->fields.size())
+				return decode(iter, names);
+
+			Local<Object> result = node->templ->NewInstance();
+			if (profiling)
+				values++;
+			dbus_message_iter_recurse(iter, &sub);
+			for (size_t i = 0; i < members; ++i) {
+				result->Set(node->fields[i], decodeShaped(&sub, names, node->children[i]));
+				dbus_message_iter_next(&sub);
+			}
+			return result;
+		}
+
+		if (node->kind == SchemaNode::DICT && type == DBUS_TYPE_ARRAY) {
+			Local<Object> result = Object::New();
+			std::vector< std::pair< Handle<Value>, Handle<Value> > > entries;
+			if (profiling)
+				values++;
+			dbus_message_iter_recurse(iter, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_DICT_ENTRY) {
+				DBusMessageIter entry;
+				dbus_message_iter_recurse(&sub, &entry);
+				Handle<Value> key = decode(&entry, names);
+				dbus_message_iter_next(&entry);
+				Handle<Value> value = decodeShaped(&entry, names, node->children[0]);
+				if (node->fields.empty())
+					result->Set(key, value);
+				else
+					entries.push_back(std::make_pair(key, value));
+				dbus_message_iter_next(&sub);
+			}
+			//Known keys go first and in schema order, whatever order the message has them in
+			for (size_t i = 0; i < node->fields.size(); ++i) {
+				for (size_t j = 0; j < entries.size(); ++j) {
+					if (!entries[j].first.IsEmpty() && entries[j].first->StrictEquals(node->fields[i])) {
+						result->Set(entries[j].first, entries[j].second);
+						entries[j].first.Clear();
+						break;
+					}
+				}
+			}
+			for (size_t j = 0; j < entries.size(); ++j) {
+				if (!entries[j].first.IsEmpty())
+					result->Set(entries[j].first, entries[j].second);
+			}
+			return result;
+		}
+
+		if (node->kind == SchemaNode::ARRAY && type == DBUS_TYPE_ARRAY && node->children[0]->kind != SchemaNode::GENERIC) {
+			Local<Array> result = Array::New();
+			if (profiling)
+				values++;
+			uint32_t count = 0;
+			dbus_message_iter_recurse(iter, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+				result->Set(count++, decodeShaped(&sub, names, node->children[0]));
+				dbus_message_iter_next(&sub);
+			}
+			return result;
+		}
+
+		return decode(iter, names);
+	}
+
+	/**
+	 * Variant signatures
+	 * Untagged values have their signature inferred in one pass. Arrays and
+	 * objects whose members all have the same full signature become typed
+	 * arrays and dicts; mixed numbers widen to doubles and anything else
+	 * that differs falls back to variants (av, a{sv}), never to a narrower
+	 * type that only fits the first member.
+	 */
+	enum ValueKind { KIND_NONE, KIND_STRING, KIND_INT32, KIND_UINT32, KIND_DOUBLE, KIND_BOOLEAN, KIND_ARRAY, KIND_OBJECT, KIND_TAGGED };
+
+	static ValueKind kindOf(Local<Value> value) {
+		if (value->IsString())
+			return KIND_STRING;
+		if (value->IsInt32())
+			return KIND_INT32;
+		if (value->IsNumber())
+			return value->IsUint32() ? KIND_UINT32 : KIND_DOUBLE;
+		if (value->IsBoolean())
+			return KIND_BOOLEAN;
+		if (value->IsArray())
+			return KIND_ARRAY;
+		if (value->IsObject())
+			return DBusBlobWrap::is(value) || DBusVariantWrap::is(value) ? KIND_TAGGED : KIND_OBJECT;
+		return KIND_NONE;
+	}
+
+	static const char* taggedSignature(Local<Value> value) {
+		return DBusBlobWrap::is(value) ? DBusBlobWrap::of(value)->signature : DBusVariantWrap::of(value)->signature;
+	}
+
+	static bool numeric(const std::string& signature) {
+		return signature == DBUS_TYPE_INT32_AS_STRING || signature == DBUS_TYPE_UINT32_AS_STRING || signature == DBUS_TYPE_DOUBLE_AS_STRING;
+	}
+
+	//Appends the signature of the members of container (by keys, if given, else by index)
+	static bool inferElements(Local<Object> container, Local<Array> keys, uint32_t length, std::string& out) {
+		if (length == 0) {
+			out += DBUS_TYPE_VARIANT_AS_STRING;
+			return true;
+		}
+
+		std::string common;
+		bool widen = false, mixed = false;
+
+		for (uint32_t i = 0; i < length; ++i) {
+			Local<Value> member = keys.IsEmpty() ? container->Get(i) : container->Get(keys->Get(i));
+			std::string signature;
+			if (!inferSignature(member, signature))
+				return false;
+			if (i == 0 || signature == common) {
+				common = signature;
+				continue;
+			}
+			//Mixed numbers all fit a double
+			if (numeric(common) && numeric(signature))
+				widen = true;
+			else
+				mixed = true;
+		}
+
+		if (mixed)
+			out += DBUS_TYPE_VARIANT_AS_STRING;
+		else if (widen)
+			out += DBUS_TYPE_DOUBLE_AS_STRING;
+		else
+			out += common;
+		return true;
+	}
+
+	static bool inferSignature(Local<Value> value, std::string& out) {
+		switch (kindOf(value)) {
+		case KIND_STRING: out += DBUS_TYPE_STRING_AS_STRING; return true;
+		case KIND_INT32: out += DBUS_TYPE_INT32_AS_STRING; return true;
+		case KIND_UINT32: out += DBUS_TYPE_UINT32_AS_STRING; return true;
+		case KIND_DOUBLE: out += DBUS_TYPE_DOUBLE_AS_STRING; return true;
+		case KIND_BOOLEAN: out += DBUS_TYPE_BOOLEAN_AS_STRING; return true;
+		case KIND_TAGGED:
+			//A blob of several arguments has no single type to stand for
+			if (!dbus_signature_validate_single(taggedSignature(value), NULL))
+				return false;
+			out += taggedSignature(value);
+			return true;
+		case KIND_ARRAY: {
+			Local<Array> array = Local<Array>::Cast(value);
+			out += DBUS_TYPE_ARRAY_AS_STRING;
+			return inferElements(array, Local<Array>(), array->Length(), out);
+		}
+		case KIND_OBJECT: {
+			Local<Object> object = value->ToObject();
+			Local<Array> keys = object->GetPropertyNames();
+			out += DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING;
+			if (!inferElements(object, keys, keys->Length(), out))
+				return false;
+			out += DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
+			return true;
+		}
+		default:
+			return false;
 		}
 	}
 
@@ -269,14 +1634,78 @@ public:
 		return true;
 	}
 
+	//64-bit values may be given as decimal strings to keep them exact
+	static bool toInt64(Local<Value> value, dbus_int64_t* out) {
+		if (value->IsString()) {
+			String::AsciiValue string(value);
+			char* end = NULL;
+			errno = 0;
+			*out = strtoll(*string, &end, 10);
+			return errno == 0 && end != *string && *end == '\0';
+		}
+		*out = value->IntegerValue();
+		return true;
+	}
+
+	static bool toUint64(Local<Value> value, dbus_uint64_t* out) {
+		if (value->IsString()) {
+			String::AsciiValue string(value);
+			char* end = NULL;
+			errno = 0;
+			*out = strtoull(*string, &end, 10);
+			return errno == 0 && end != *string && *end == '\0' && (*string)[0] != '-';
+		}
+		double number = value->NumberValue();
+		if (number < 0)
+			return false;
+		//IntegerValue() saturates at 2^63, the upper half has to go through the double
+		*out = number >= 9223372036854775808.0 ? static_cast<dbus_uint64_t>(number) : static_cast<dbus_uint64_t>(value->IntegerValue());
+		return true;
+	}
+
+	//Writes value into out using exactly the width of type
+	static bool encodeFixed(int type, Local<Value> value, void* out) {
+		DBusFixedValue* data = static_cast<DBusFixedValue*>(out);
+		switch (type) {
+		case DBUS_TYPE_BYTE: data->y = static_cast<unsigned char>(value->Uint32Value()); return true;
+		case DBUS_TYPE_BOOLEAN: data->b = value->BooleanValue(); return true;
+		case DBUS_TYPE_INT16: data->n = static_cast<dbus_int16_t>(value->Int32Value()); return true;
+		case DBUS_TYPE_UINT16: data->q = static_cast<dbus_uint16_t>(value->Uint32Value()); return true;
+		case DBUS_TYPE_INT32: data->i = value->Int32Value(); return true;
+		case DBUS_TYPE_UINT32: data->u = value->Uint32Value(); return true;
+		case DBUS_TYPE_INT64: return toInt64(value, &data->x);
+		case DBUS_TYPE_UINT64: return toUint64(value, &data->t);
+		case DBUS_TYPE_DOUBLE: data->d = value->NumberValue(); return true;
+		default: return false;
+		}
+	}
+
 	static bool encodeInteger(int type, Local<Value> value, DBusMessageIter *iter) {
-		dbus_uint64_t data = value->IntegerValue();
+		DBusFixedValue data;
+		if (!encodeFixed(type, value, &data))
+			return false;
 		if (!dbus_message_iter_append_basic(iter, type, &data)) {
 			return false;
 		}
 		return true;
 	}
 
+	static bool encodeFixedArray(int type, Local<Array> values, DBusMessageIter *iter) {
+		uint32_t length = values->Length();
+		int size = dbus_fixed_type_size(type);
+		//malloc keeps the block aligned for the widest element type
+		char* data = static_cast<char*>(malloc(length * size + 1));
+		bool no_error_status = data != NULL;
+
+		for (uint32_t i = 0; no_error_status && i < length; ++i)
+			no_error_status = encodeFixed(type, values->Get(i), data + i * size);
+
+		if (no_error_status)
+			no_error_status = dbus_message_iter_append_fixed_array(iter, type, &data, length);
+		free(data);
+		return no_error_status;
+	}
+
 	static bool encodeString(int type, Local<Value> value, DBusMessageIter *iter) {
 		String::Utf8Value data_val(value->ToString());
 		const char *data = *data_val;
@@ -294,7 +1723,7 @@ public:
 		return true;
 	}
 
-	static bool encodeArray(int type, Local<Value> value, DBusMessageIter *iter, DBusSignatureIter* siter) {
+	static bool encodeArray(int type, Local<Value> value, DBusMessageIter *iter, DBusSignatureIter* siter, SchemaNode* node) {
 
 		if (dbus_signature_iter_get_element_type(siter) == DBUS_TYPE_DICT_ENTRY) {
 			//This element is a DICT type of D-Bus
@@ -322,12 +1751,15 @@ public:
 			//for each signature
 			dbus_signature_iter_recurse(&dictSiter, &dictSubSiter); //the key
 			dbus_signature_iter_next(&dictSubSiter); //the value
+			//Every entry shares the value signature, so it is only read once
+			char *cstr = dbus_signature_iter_get_signature(&dictSubSiter);
 
 			bool no_error_status = true;
 			for(int i=0; i<len; i++) {
 				DBusMessageIter dict_iter;
 
 				if (!dbus_message_iter_open_container(&subIter, DBUS_TYPE_DICT_ENTRY, NULL, &dict_iter)) {
+					dbus_free(cstr);
 					return false;
 				}
 
@@ -340,22 +1772,21 @@ public:
 				dbus_message_iter_append_basic(&dict_iter, DBUS_TYPE_STRING, &prop_str);
 
 				//append the value 
-				char *cstr = dbus_signature_iter_get_signature(&dictSubSiter);
-				if ( ! encode(value_object->Get(prop_name), &dict_iter, cstr)) {
+				if ( ! encode(value_object->Get(prop_name), &dict_iter, cstr, node ? node->child(0) : NULL)) {
 					no_error_status = false;
 				}
 
-			//release resource
-			dbus_free(cstr);
 			dbus_message_iter_close_container(&subIter, &dict_iter); 
 			//error on encode message, break and return
-			if (!no_error_status) 
+			if (!no_error_status) {
+				dbus_free(cstr);
 				return false;
+			}
 		}
+		//release resource
+		dbus_free(cstr);
 		dbus_message_iter_close_container(iter, &subIter);
-		//Check errors on message
-		if (!no_error_status) 
-			return no_error_status;
+		return no_error_status;
 		} else {
 			//This element is a Array type of D-Bus 
 			if (! value->IsArray()) {
@@ -370,39 +1801,52 @@ public:
 			array_sig = dbus_signature_iter_get_signature(&arraySIter);
 
 			if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, array_sig, &subIter)) {
-				delete (array_sig); 
+				dbus_free(array_sig); 
 				return false; 
 			}
 
 			Local<Array> arrayData = Local<Array>::Cast(value);
 			bool no_error_status = true;
+			int element_type = dbus_signature_iter_get_current_type(&arraySIter);
+			if (dbus_fixed_type_size(element_type)) {
+				no_error_status = encodeFixedArray(element_type, arrayData, &subIter);
+				dbus_message_iter_close_container(iter, &subIter);
+				dbus_free(array_sig);
+				return no_error_status;
+			}
 			for (unsigned int i=0; i < arrayData->Length(); i++) {
 				Local<Value> arrayItem = arrayData->Get(i);
-				if (!encode(arrayItem, &subIter, array_sig) ) {
+				if (!encode(arrayItem, &subIter, array_sig, node ? node->child(0) : NULL) ) {
 					no_error_status = false;
 					break;
 				}
 			}
 			dbus_message_iter_close_container(iter, &subIter);
-			delete (array_sig);
+			dbus_free(array_sig);
 			return no_error_status;
 		}
 	}
 
 	static bool encodeVariant(int type, Local<Value> value, DBusMessageIter *iter, DBusSignatureIter* siter) {
 		DBusMessageIter sub_iter;
-		DBusSignatureIter var_siter;
-		//FIXME: the variable stub
-		char *var_sig = signatureFromValue(value);
+		std::string var_sig;
 
-		dbus_signature_iter_recurse(siter, &var_siter);
+		//An explicit tag wins over anything inferred
+		if (DBusVariantWrap::is(value)) {
+			DBusVariantWrap* variant = DBusVariantWrap::of(value);
+			var_sig = variant->signature;
+			value = Local<Value>::New(variant->value);
+		}
+		else if (!inferSignature(value, var_sig)) {
+			return false;
+		}
 
-		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, var_sig, &sub_iter)) {
+		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, var_sig.c_str(), &sub_iter)) {
 			return false;
 		}
 
 		//encode the object to dbus message 
-		if (!encode(value, &sub_iter, var_sig)) { 
+		if (!encode(value, &sub_iter, var_sig.c_str())) { 
 			dbus_message_iter_close_container(iter, &sub_iter);
 			return false;
 		}
@@ -410,41 +1854,86 @@ public:
 		return true;
 	}
 
-	static bool encodeStruct(int type, Local<Value> value, DBusMessageIter *iter, DBusSignatureIter* siter) {
+	static bool encodeStruct(int type, Local<Value> value, DBusMessageIter *iter, DBusSignatureIter* siter, SchemaNode* node) {
 		DBusMessageIter sub_iter;
 		DBusSignatureIter struct_siter;
 
+		if (!value->IsObject())
+			return false;
+
 		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &sub_iter)) {
 			return false;
 		}
 
 		Local<Object> value_object = value->ToObject();
-
-		Local<Array> prop_names = value_object->GetPropertyNames();
-		int len = prop_names->Length(); 
 		bool no_error_status = true;
+		bool shaped = node && node->kind == SchemaNode::STRUCT;
+		Local<Array> prop_names;
+
+		//A schema naming more or fewer fields than the struct has is ignored
+		if (shaped) {
+			size_t members = 0;
+			dbus_signature_iter_recurse(siter, &struct_siter);
+			do {
+				members++;
+			} while (dbus_signature_iter_next(&struct_siter));
+			shaped = members == node->fields.size();
+		}
+
+		//Members are taken by schema field name, by index for arrays and
+		//only otherwise in property enumeration order
+		if (!shaped && !value->IsArray())
+			prop_names = value_object->GetPropertyNames();
 
 		dbus_signature_iter_recurse(siter, &struct_siter);
-		for(int i=0 ; i<len; i++) {
+		uint32_t i = 0;
+		do {
 			char *sig = dbus_signature_iter_get_signature(&struct_siter);
-			Local<Value> prop_name = prop_names->Get(i);
+			Local<Value> member;
+
+			if (shaped)
+				member = value_object->Get(node->fields[i]);
+			else if (prop_names.IsEmpty())
+				member = value_object->Get(i);
+			else
+				member = value_object->Get(prop_names->Get(i));
 
-			if (!encode(value_object->Get(prop_name), &sub_iter, sig) ) {
+			if (!encode(member, &sub_iter, sig, shaped ? node->child(i) : NULL) ) {
 				no_error_status = false;
 			}
 
 			dbus_free(sig);
+			i++;
+		} while (no_error_status && dbus_signature_iter_next(&struct_siter));
 
-			if (!dbus_signature_iter_next(&struct_siter) || !no_error_status) {
-				break;
-			}
-		}
 		dbus_message_iter_close_container(iter, &sub_iter);
 		return no_error_status;
 	}
 
-	static bool encode(Local<Value> value, DBusMessageIter *iter, const char* sig) {
+	//Pre-encoded values are copied over as they are, if they were encoded for sig
+	static bool encodeBlob(Local<Value> value, DBusMessageIter *iter, const char* sig) {
+		DBusBlobWrap* blob = DBusBlobWrap::of(value);
+		DBusMessageIter from;
+
+		if (strcmp(blob->signature, sig) != 0 || !dbus_message_iter_init(blob->body, &from))
+			return false;
+		return dbus_messages_iter_copy(&from, iter);
+	}
+
+	static bool encode(Local<Value> value, DBusMessageIter *iter, const char* sig, SchemaNode* node = NULL) {
 		
+		if (profiling)
+			values++;
+		if (DBusBlobWrap::is(value))
+			return encodeBlob(value, iter, sig);
+		//Outside of a variant the tag only has to agree with the signature
+		if (sig[0] != DBUS_TYPE_VARIANT && DBusVariantWrap::is(value)) {
+			DBusVariantWrap* variant = DBusVariantWrap::of(value);
+			if (strcmp(variant->signature, sig) != 0)
+				return false;
+			value = Local<Value>::New(variant->value);
+		}
+
 		DBusSignatureIter siter;
 		dbus_signature_iter_init(&siter, sig);
 
@@ -473,14 +1962,14 @@ public:
 			return encodeDouble(type, value, iter);
 
 		case DBUS_TYPE_ARRAY: 
-			return encodeArray(type, value, iter, &siter);
+			return encodeArray(type, value, iter, &siter, node);
 			
 		
 		case DBUS_TYPE_VARIANT: 
 			return encodeVariant(type, value, iter, &siter);
 
 		case DBUS_TYPE_STRUCT: 
-			return encodeStruct(type, value, iter, &siter);
+			return encodeStruct(type, value, iter, &siter, node);
 		
 		default: 
 			printf("Unknown type!\n");
@@ -490,11 +1979,18 @@ public:
 	}
 
 	static Handle<Value> getArguments(Local<String> property, const AccessorInfo& info) {
-		DBusMessage *message = *THIS_MESSAGE(info);
+		DBusMessageWrap *wrap = THIS_MESSAGE(info);
+		DBusMessage *message = live(info);
 		DBusMessageIter iter;
 		int type;
 		int argument_count = 0;
 		int count;
+		uint64_t start = (wrap->trace || profiling) ? uv_hrtime() : 0;
+		uint64_t counted = values;
+		SchemaNode* schema = wrap->schemaRoot();
+
+		if (!message)
+			return Undefined();
 
 		if ((count=dbus_messages_size(message)) <=0 ) {
 			return Undefined();
@@ -502,37 +1998,68 @@ public:
 
 		Local<Array> resultArray = Array::New(count);
 		dbus_message_iter_init(message, &iter);
+		DecodingScope decodingScope(message);
 
 		while ((type=dbus_message_iter_get_arg_type(&iter)) != DBUS_TYPE_INVALID) {
-			Handle<Value> valueItem = decode(&iter);
+			Handle<Value> valueItem = decodeShaped(&iter, wrap->names, schema ? schema->child(argument_count) : NULL);
 			resultArray->Set(argument_count, valueItem);
 			//for next message
 			dbus_message_iter_next (&iter);
 			argument_count++;
 		} //end of while loop
 
+		//Time spent decoding is charged to the traced call owning this reply
+		if (wrap->trace)
+			wrap->trace->decode += uv_hrtime() - start;
+		if (profiling)
+			record(decodeProfile, dbus_message_get_signature(message), start, counted, message);
+
 		return resultArray; 
 	}
 	
 	static void setArguments(Local<String> property, Local<Value> value, const AccessorInfo& info) {
+		if (live(info))
+			appendArguments(THIS_MESSAGE(info), value);
+	};
+
+	static void appendArguments(DBusMessageWrap* wrap, Local<Value> value) {
 		DBusError error;
-		DBusMessageWrap *wrap = THIS_MESSAGE(info);
-		DBusMessage *message = *wrap;
+		DBusMessage *message = wrap->message;
 		DBusMessageIter iter;
 		DBusSignatureIter siter;
 		uint32_t count = 0;
 		const char* signature = wrap->signature;
+		SchemaNode* schema = wrap->schemaRoot();
+		uint64_t start = profiling ? uv_hrtime() : 0;
+		uint64_t counted = values;
+
+		if (!signature) {
+			ThrowException(Exception::Error(String::New("Message signature must be set before its arguments!")));
+			return;
+		}
 
 		 dbus_error_init(&error);        
 		if (!dbus_signature_validate(signature, &error)) {
 			printf("Invalid signature: %s\n",error.message);
+			dbus_error_free(&error);
+			return;
 		}
 		
 		dbus_signature_iter_init(&siter, signature);
 		dbus_message_iter_init_append(message, &iter);
 
+		//A blob of the whole signature becomes the body in one go
+		if (DBusBlobWrap::is(value)) {
+			if (!encodeBlob(value, &iter, signature))
+				ThrowException(Exception::TypeError(String::New("Blob was not encoded for the message signature!")));
+			else if (profiling)
+				record(encodeProfile, signature, start, counted, message);
+			return;
+		}
+
 		if (!value->IsArray()) {
 			printf("NO ARRAY!");
+			return;
 		}
 
 		Local<Array> arguments = Local<Array>::Cast(value);
@@ -552,7 +2079,7 @@ public:
 
 
 			//encode to message with given v8 Objects and the signature
-			if (! encode(arguments->Get(count), &iter, arg_sig)) {
+			if (! encode(arguments->Get(count), &iter, arg_sig, schema ? schema->child(count) : NULL)) {
 				printf("ERRORZ\n");
 				dbus_free(arg_sig);
 				break;
@@ -562,18 +2089,23 @@ public:
 			count++;
 		} while (dbus_signature_iter_next(&siter));
 		
-		
-
+		if (profiling)
+			record(encodeProfile, signature, start, counted, message);
 	};
 
 	static Handle<Value> getSignature(Local<String> property, const AccessorInfo& info) {
-		return String::New(THIS_MESSAGE(info)->signature);
+		const char* signature = THIS_MESSAGE(info)->signature;
+		if (!signature)
+			return Undefined();
+		return String::New(signature);
 	}
 
 	static void setSignature(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
 		if (value->IsString()) {
+			DBusMessageWrap* wrap = THIS_MESSAGE(info);
 			String::Utf8Value derp(value);			
-			THIS_MESSAGE(info)->signature = strdup(*derp);
+			free(const_cast<char*>(wrap->signature));
+			wrap->signature = strdup(*derp);
 		}
 		else {
 			printf("FUUU\n");
@@ -581,128 +2113,1328 @@ public:
 		
 	}
 
+	static Handle<Value> getSchema(Local<String> property, const AccessorInfo& info) {
+		DBusMessageWrap* wrap = THIS_MESSAGE(info);
+		if (wrap->schema.IsEmpty())
+			return Null();
+		return wrap->schema;
+	}
+
+	static void setSchema(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
+		DBusMessageWrap* wrap = THIS_MESSAGE(info);
+		if (!value->IsNull() && !value->IsUndefined() && !DBusSchemaWrap::constructorTemplate->HasInstance(value)) {
+			ThrowException(Exception::TypeError(String::New("Schema must be created with schema()!")));
+			return;
+		}
+		if (!wrap->schema.IsEmpty())
+			wrap->schema.Dispose();
+		wrap->schema.Clear();
+		if (value->IsObject())
+			wrap->schema = Persistent<Object>::New(value->ToObject());
+	}
+
 	static Handle<Value> getErrorName(Local<String> property, const AccessorInfo& info) {
-		return String::New(dbus_message_get_error_name(*THIS_MESSAGE(info)));
+		DBusMessage* message = live(info);
+		return name(info, message ? dbus_message_get_error_name(message) : NULL);
 	};
 
 	static void setErrorName(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
-		dbus_message_set_error_name(*THIS_MESSAGE(info), *String::Utf8Value(value->ToString()));
+		DBusMessage* message = live(info);
+		if (message)
+			dbus_message_set_error_name(message, *String::Utf8Value(value->ToString()));
 	};
 
 	static Handle<Value> getMember(Local<String> property, const AccessorInfo& info) {
-		DBusMessage* message = *THIS_MESSAGE(info);
+		DBusMessage* message = live(info);
+		if (!message)
+			return Undefined();
 		int type = dbus_message_get_type(message) ;
 		if (type == DBUS_MESSAGE_TYPE_METHOD_CALL || type == DBUS_MESSAGE_TYPE_METHOD_RETURN || type == DBUS_MESSAGE_TYPE_SIGNAL)
-			return String::New(dbus_message_get_member(*THIS_MESSAGE(info)));
+			return name(info, dbus_message_get_member(message));
 		else
 			return Undefined();
 	};
 
 	static void setMember(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
-		dbus_message_set_member (*THIS_MESSAGE(info), *String::Utf8Value(value->ToString()));
+		DBusMessage* message = live(info);
+		if (message)
+			dbus_message_set_member(message, *String::Utf8Value(value->ToString()));
 	};
 
 	static Handle<Value> getInterface(Local<String> property, const AccessorInfo& info) {
-		DBusMessage* message = *THIS_MESSAGE(info);
+		DBusMessage* message = live(info);
+		if (!message)
+			return Undefined();
 		int type = dbus_message_get_type(message) ;
 		if (type == DBUS_MESSAGE_TYPE_METHOD_CALL || type == DBUS_MESSAGE_TYPE_METHOD_RETURN || type == DBUS_MESSAGE_TYPE_SIGNAL)
-			return String::New(dbus_message_get_interface(message));
+			return name(info, dbus_message_get_interface(message));
 		else
 			return Undefined();
 	};
 
 	static void setInterface(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
-		dbus_message_set_interface(*THIS_MESSAGE(info), *String::Utf8Value(value->ToString()));
+		DBusMessage* message = live(info);
+		if (message)
+			dbus_message_set_interface(message, *String::Utf8Value(value->ToString()));
 	};
 	 
 
 
 };
 Persistent<FunctionTemplate> DBusMessageWrap::constructorTemplate;
+std::vector<void*> DBusMessageWrap::pool;
+DBusMessage* DBusMessageWrap::decoding = NULL;
+bool DBusMessageWrap::profiling = false;
+uint64_t DBusMessageWrap::values = 0;
+std::map<std::string, CodecStats> DBusMessageWrap::decodeProfile;
+std::map<std::string, CodecStats> DBusMessageWrap::encodeProfile;
+size_t DBusMessageWrap::poolSize = 64;
+
+/**
+ * Once this many bytes are queued for writing, send() starts returning
+ * false until the queue has drained below the mark again.
+ */
+#define DBUS_DEFAULT_HIGH_WATER_MARK (1024 * 1024)
+
+/**
+ * How many replies, method calls and signals are handed to JS per turn
+ * of the event loop before the rest wait for the next one.
+ */
+#define DBUS_DEFAULT_REPLY_BUDGET 256
+#define DBUS_DEFAULT_CALL_BUDGET 128
+#define DBUS_DEFAULT_SIGNAL_BUDGET 64
+
+/**
+ * Distinct signals one SignalPolicy holds back at most; the rest of the
+ * subscription's traffic cannot make it grow past this.
+ */
+#define SIGNAL_POLICY_LIMIT 4096
+
+/**
+ * Bytes of marshalled traffic a monitor buffers for its capture file
+ * between writes; messages past it are counted as dropped.
+ */
+#define DBUS_CAPTURE_BUFFER_LIMIT (16 * 1024 * 1024)
+
+/**
+ * Once this many deliveries are waiting for JS the connection stops
+ * reading from its socket, and resumes when they are down to half.
+ */
+#define DBUS_DEFAULT_INBOUND_HIGH_WATER_MARK 4096
+
+class DBusConnectionWrap : ObjectWrap {
+public:
+
+	static Persistent<FunctionTemplate> constructorTemplate;
+
+	DBusConnection* connection;
+	bool priv;
+	TraceRing* trace;
+	InternTable* names;
+	long highWaterMark;
+	bool needDrain;
+	Persistent<Function> drainCallback;
+	
+	
+	DBusConnectionWrap(DBusConnection* c, bool p) : ObjectWrap(), connection(c), priv(p), trace(NULL), names(new InternTable()), 
+		highWaterMark(DBUS_DEFAULT_HIGH_WATER_MARK), needDrain(false), dispatcher(NULL), ownerNotifier(NULL), monitor(NULL), monitorNotifier(NULL), deliverer(NULL), 
+		queued(0), inboundHighWaterMark(DBUS_DEFAULT_INBOUND_HIGH_WATER_MARK), paused(false), reportedPaused(false), 
+		busType(-1), reconnectTimer(NULL), reconnectDelay(0), reconnectMaxDelay(0), reconnectBackoff(0), reconnectAttempts(0), disconnectedAt(0) {
+		laneBudget[LANE_REPLY] = DBUS_DEFAULT_REPLY_BUDGET;
+		laneBudget[LANE_CALL] = DBUS_DEFAULT_CALL_BUDGET;
+		laneBudget[LANE_SIGNAL] = DBUS_DEFAULT_SIGNAL_BUDGET;
+	};
+	
+	~DBusConnectionWrap() {
+		delete trace;
+		names->unref();
+		if (!drainCallback.IsEmpty())
+			drainCallback.Dispose();
+		if (!ownerCallback.IsEmpty())
+			ownerCallback.Dispose();
+		if (!flowCallback.IsEmpty())
+			flowCallback.Dispose();
+		if (!reconnectCallback.IsEmpty())
+			reconnectCallback.Dispose();
+		delete monitor;
+	};
+	
+	operator DBusConnection* () const {
+		return connection;
+	};
+
+
+	static void Init(Handle<Object> target) {
+		
+		Local<FunctionTemplate> t = FunctionTemplate::New(New);
+		constructorTemplate = Persistent<FunctionTemplate>::New(t);
+		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+		constructorTemplate->SetClassName(String::NewSymbol("DBusConnection"));
+
+		NODE_SET_METHOD(target, "open", open);
+		NODE_SET_METHOD(target, "get", get);
+		NODE_SET_METHOD(target, "callBlocking", callBlocking);
+
+		//Blocking calls use libdbus from worker threads
+		dbus_threads_init_default();
+		uv_mutex_init(&blockingLock);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "close", close);
+		NODE_SET_PROTOTYPE_METHOD(t, "requestName", requestName);
+		NODE_SET_PROTOTYPE_METHOD(t, "releaseName", releaseName);
+		NODE_SET_PROTOTYPE_METHOD(t, "addMatch", addMatch);
+		NODE_SET_PROTOTYPE_METHOD(t, "removeMatch", removeMatch);
+		NODE_SET_PROTOTYPE_METHOD(t, "setReconnect", setReconnect);
+
+		//NODE_SET_PROTOTYPE_METHOD(t, "close", close);
+		NODE_SET_PROTOTYPE_METHOD(t, "canSendType", canSendType);
+		
+		NODE_SET_PROTOTYPE_METHOD(t, "addFilter", addFilter);
+		//NODE_SET_PROTOTYPE_METHOD(t, "removeFilter", removeFilter);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "registerObjectPath", registerObjectPath);
+		NODE_SET_PROTOTYPE_METHOD(t, "unregisterObjectPath", unregisterObjectPath);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "send", send);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "setHighWaterMark", setHighWaterMark);
+		NODE_SET_PROTOTYPE_METHOD(t, "setLaneBudgets", setLaneBudgets);
+		NODE_SET_PROTOTYPE_METHOD(t, "cancel", cancel);
+		NODE_SET_PROTOTYPE_METHOD(t, "relay", relay);
+		NODE_SET_PROTOTYPE_METHOD(t, "unrelay", unrelay);
+		NODE_SET_PROTOTYPE_METHOD(t, "setInboundHighWaterMark", setInboundHighWaterMark);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "becomeMonitor", becomeMonitor);
+		NODE_SET_PROTOTYPE_METHOD(t, "drainMonitor", drainMonitor);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "trackNames", trackNames);
+		NODE_SET_PROTOTYPE_METHOD(t, "watchName", watchName);
+		NODE_SET_PROTOTYPE_METHOD(t, "nameOwner", nameOwner);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "setTracing", setTracing);
+		NODE_SET_PROTOTYPE_METHOD(t, "drainTrace", drainTrace);
+
+		NODE_SET_GETTER(t, "isConnected", isConnected);
+		NODE_SET_GETTER(t, "isAuthenticated", isAuthenticated);
+		NODE_SET_GETTER(t, "isAnonymous", isAnonymous);
+		NODE_SET_GETTER(t, "serverId", serverId);
+		NODE_SET_GETTER(t, "outgoingSize", outgoingSize);
+		NODE_SET_GETTER_SETTER(t, "maxMessageSize", getMaxMessageSize, setMaxMessageSize);
+		NODE_SET_GETTER_SETTER(t, "maxReceivedSize", getMaxReceivedSize, setMaxReceivedSize);
+		
+	};
+
+	class SignalPolicy;
+	class WatchBaton;
+
+	/**
+	 * MessagePredicate
+	 * Header conditions a message must meet before a subscription's callback
+	 * hears of it: { type, path (prefix), interface, member, signature, arg0 }.
+	 * Unset fields match anything; checked in handleMessage, so messages
+	 * that fail never reach V8.
+	 */
+	class MessagePredicate {
+	public:
+		MessagePredicate() : type(DBUS_MESSAGE_TYPE_INVALID), hasArg0(false) { };
+
+		//Whole path components only: /a matches /a and /a/b but not /ab
+		static bool underPath(const std::string& prefix, const char* path) {
+			size_t length = prefix.length();
+			if (!path || strncmp(path, prefix.c_str(), length) != 0)
+				return false;
+			return path[length] == '\0' || path[length] == '/' || prefix == "/";
+		};
+
+		static bool equals(const std::string& expected, const char* value) {
+			return expected.empty() || (value && expected == value);
+		};
+
+		bool matches(DBusMessage* message) const {
+			if (type != DBUS_MESSAGE_TYPE_INVALID && dbus_message_get_type(message) != type)
+				return false;
+			if (!equals(member, dbus_message_get_member(message)) || !equals(interface, dbus_message_get_interface(message)))
+				return false;
+			if (!path.empty() && !underPath(path, dbus_message_get_path(message)))
+				return false;
+			if (!signature.empty() && !dbus_message_has_signature(message, signature.c_str()))
+				return false;
+			if (hasArg0) {
+				DBusMessageIter iter;
+				const char* value = NULL;
+				int argType;
+				if (!dbus_message_iter_init(message, &iter))
+					return false;
+				argType = dbus_message_iter_get_arg_type(&iter);
+				if (argType != DBUS_TYPE_STRING && argType != DBUS_TYPE_OBJECT_PATH && argType != DBUS_TYPE_SIGNATURE)
+					return false;
+				dbus_message_iter_get_basic(&iter, &value);
+				return arg0 == value;
+			}
+			return true;
+		};
+
+		int type;
+		std::string path;
+		std::string interface;
+		std::string member;
+		std::string signature;
+		std::string arg0;
+		bool hasArg0;
+	};
+
+	class ConnectionCallbackBaton {
+	public:
+		ConnectionCallbackBaton(Persistent<Function> cb, DBusConnectionWrap* conn) : callback(cb), connection(conn), trace(NULL), policy(NULL), pending(NULL), serial(0), cancelled(false), refs(1) { };
+		~ConnectionCallbackBaton() { 
+			callback.Dispose();
+			delete trace;
+			if (policy)
+				policy->release();
+		};
+		Persistent<Function> callback;
+		DBusConnectionWrap* connection;
+		TraceEntry* trace;
+		SignalPolicy* policy;
+		//Only messages from whoever currently owns this name get through
+		std::string sender;
+		MessagePredicate predicate;
+		//For replies: the call this is waiting on, and whether JS lost interest
+		DBusPendingCall* pending;
+		dbus_uint32_t serial;
+		bool cancelled;
+		//One per registration or pending call, one for the connection's memory of a filter or object path, one per queued delivery
+		unsigned int refs;
+	};
+
+	/**
+	 * SignalPolicy
+	 * Holds back signals for one subscription before any V8 object exists.
+	 * Signals are coalesced by path, interface and member (plus the changed
+	 * interface for PropertiesChanged) keeping only the latest, or merging
+	 * change sets when asked to. A key is delivered once it has been quiet
+	 * for the debounce period, and at most rate signals go out per second.
+	 * Times are in nanoseconds so rates above 1000/s still hold; pending is
+	 * kept in order of last update, so the front is always the next due.
+	 * Past SIGNAL_POLICY_LIMIT keys the oldest one is handed to the signal
+	 * lane as it is.
+	 */
+	class SignalPolicy {
+	public:
+		struct Pending {
+			std::string key;
+			DBusMessage* message;
+			uint64_t updated;
+		};
+
+		SignalPolicy(ConnectionCallbackBaton* b, bool m, unsigned int d, unsigned int r) : 
+			baton(b), merge(m), debounce(d * 1000000ULL), interval(r ? 1000000000ULL / r : 0), nextDelivery(0), coalesced(0) {
+			uv_timer_init(uv_default_loop(), &this->timer);
+			this->timer.data = this;
+		};
+
+		ConnectionCallbackBaton* baton;
+		bool merge;
+		uint64_t debounce;
+		uint64_t interval;
+		//Earliest time the rate lets the next signal out
+		uint64_t nextDelivery;
+		unsigned int coalesced;
+		std::list<Pending> pending;
+		std::map<std::string, std::list<Pending>::iterator> index;
+		uv_timer_t timer;
+
+		static std::string keyOf(DBusMessage* message) {
+			std::string key;
+			const char* parts[] = { dbus_message_get_path(message), dbus_message_get_interface(message), dbus_message_get_member(message) };
+			for (int i = 0; i < 3; ++i) {
+				if (parts[i])
+					key += parts[i];
+				key += '\0';
+			}
+			if (isPropertiesChanged(message)) {
+				const char* changed = NULL;
+				dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &changed, DBUS_TYPE_INVALID);
+				if (changed)
+					key += changed;
+			}
+			return key;
+		};
+
+		static bool isPropertiesChanged(DBusMessage* message) {
+			return dbus_message_is_signal(message, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged") && dbus_message_has_signature(message, "sa{sv}as");
+		};
+
+		static void collectKeys(DBusMessageIter* iter, std::set<std::string>& keys) {
+			DBusMessageIter sub;
+			dbus_message_iter_recurse(iter, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+				DBusMessageIter entry;
+				const char* key;
+				if (dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_DICT_ENTRY) {
+					dbus_message_iter_recurse(&sub, &entry);
+					dbus_message_iter_get_basic(&entry, &key);
+				}
+				else {
+					dbus_message_iter_get_basic(&sub, &key);
+				}
+				keys.insert(key);
+				dbus_message_iter_next(&sub);
+			}
+		};
+
+		//Appends the entries of the a{sv} or as under iter whose key is not in skip
+		static bool copyExcept(DBusMessageIter* iter, DBusMessageIter* out, const std::set<std::string>& skip) {
+			DBusMessageIter sub;
+			dbus_message_iter_recurse(iter, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+				DBusMessageIter entry, copy;
+				const char* key;
+				bool ok = true;
+
+				if (dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_DICT_ENTRY) {
+					dbus_message_iter_recurse(&sub, &entry);
+					dbus_message_iter_get_basic(&entry, &key);
+					if (!skip.count(key)) {
+						ok = dbus_message_iter_open_container(out, DBUS_TYPE_DICT_ENTRY, NULL, &copy) &&
+							dbus_messages_iter_copy(&entry, &copy) &&
+							dbus_message_iter_close_container(out, &copy);
+					}
+				}
+				else {
+					dbus_message_iter_get_basic(&sub, &key);
+					if (!skip.count(key))
+						ok = dbus_message_iter_append_basic(out, DBUS_TYPE_STRING, &key);
+				}
+				if (!ok)
+					return false;
+				dbus_message_iter_next(&sub);
+			}
+			return true;
+		};
+
+		/**
+		 * Folds a newer PropertiesChanged into an older one: the newer values
+		 * win, and anything the newer signal changed or invalidated is dropped
+		 * from the older one. Returns NULL if the merge could not be built.
+		 */
+		static DBusMessage* mergeProperties(DBusMessage* older, DBusMessage* newer) {
+			DBusMessageIter olderIter, newerIter, out, changed, invalidated;
+			std::set<std::string> newerKeys, newerInvalidated, skip;
+			const char* interface;
+			DBusMessage* merged = dbus_message_new_signal(dbus_message_get_path(newer), DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+			bool ok;
+
+			if (!merged)
+				return NULL;
+			dbus_message_set_sender(merged, dbus_message_get_sender(newer));
+
+			dbus_message_iter_init(older, &olderIter);
+			dbus_message_iter_init(newer, &newerIter);
+			dbus_message_iter_get_basic(&newerIter, &interface);
+			dbus_message_iter_next(&olderIter);
+			dbus_message_iter_next(&newerIter);
+
+			collectKeys(&newerIter, newerKeys);
+			DBusMessageIter newerInvalidatedIter = newerIter;
+			dbus_message_iter_next(&newerInvalidatedIter);
+			collectKeys(&newerInvalidatedIter, newerInvalidated);
+			skip = newerKeys;
+			skip.insert(newerInvalidated.begin(), newerInvalidated.end());
+
+			dbus_message_iter_init_append(merged, &out);
+			ok = dbus_message_iter_append_basic(&out, DBUS_TYPE_STRING, &interface);
+
+			//changed: older entries not superseded, then the newer ones
+			ok = ok && dbus_message_iter_open_container(&out, DBUS_TYPE_ARRAY, "{sv}", &changed);
+			ok = ok && copyExcept(&olderIter, &changed, skip);
+			ok = ok && copyExcept(&newerIter, &changed, std::set<std::string>());
+			ok = dbus_message_iter_close_container(&out, &changed) && ok;
+
+			//invalidated: older names not changed since, then the newer ones
+			dbus_message_iter_next(&olderIter);
+			ok = ok && dbus_message_iter_open_container(&out, DBUS_TYPE_ARRAY, "s", &invalidated);
+			ok = ok && copyExcept(&olderIter, &invalidated, skip);
+			ok = ok && copyExcept(&newerInvalidatedIter, &invalidated, std::set<std::string>());
+			ok = dbus_message_iter_close_container(&out, &invalidated) && ok;
+
+			if (!ok) {
+				dbus_message_unref(merged);
+				return NULL;
+			}
+			return merged;
+		};
+
+		//Takes a reference to message and holds it until it is flushed
+		void add(DBusMessage* message) {
+			std::string key = keyOf(message);
+			std::map<std::string, std::list<Pending>::iterator>::iterator found = index.find(key);
+			uint64_t now = uv_hrtime();
+
+			if (found == index.end()) {
+				if (pending.size() >= SIGNAL_POLICY_LIMIT) {
+					baton->connection->enqueue(LANE_SIGNAL, baton, pending.front().message, NULL);
+					index.erase(pending.front().key);
+					pending.pop_front();
+				}
+				Pending entry = { key, dbus_message_ref(message), now };
+				index[key] = pending.insert(pending.end(), entry);
+			}
+			else {
+				Pending& entry = *found->second;
+				DBusMessage* merged = merge && isPropertiesChanged(message) ? mergeProperties(entry.message, message) : NULL;
+				dbus_message_unref(entry.message);
+				entry.message = merged ? merged : dbus_message_ref(message);
+				entry.updated = now;
+				pending.splice(pending.end(), pending, found->second);
+				coalesced++;
+			}
+			schedule(now);
+		};
+
+		void schedule(uint64_t now) {
+			if (!baton || pending.empty())
+				return;
+
+			uint64_t due = pending.front().updated + debounce;
+			if (interval && nextDelivery > due)
+				due = nextDelivery;
+			//The timer counts in milliseconds; round up so it does not fire early
+			uv_timer_start(&this->timer, flush, due > now ? (due - now + 999999) / 1000000 : 0, 0);
+		};
+
+		static void flush(uv_timer_t* timer, int status) {
+			SignalPolicy* policy = static_cast<SignalPolicy*>(timer->data);
+			uint64_t now = uv_hrtime();
+			HandleScope scope;
+
+			//A callback may unsubscribe, which releases the policy under us
+			while (policy->baton && !policy->pending.empty()) {
+				Pending& front = policy->pending.front();
+				if (now < front.updated + policy->debounce)
+					break;
+				if (policy->interval && now < policy->nextDelivery)
+					break;
+
+				DBusMessage* message = front.message;
+				policy->index.erase(front.key);
+				policy->pending.pop_front();
+				//Rates above the timer's 1ms resolution go out in bursts of up to 1ms worth
+				if (policy->interval) {
+					uint64_t slack = policy->interval < 1000000 ? 1000000 - policy->interval : 0;
+					policy->nextDelivery = std::max(policy->nextDelivery, now - slack) + policy->interval;
+				}
+
+				TryCatch tryCatch;
+				Handle<Value> argv[1] = { DBusMessageWrap::finalizeMessage(message, policy->baton->connection->names) };
+				policy->baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+				if (tryCatch.HasCaught())
+					FatalException(tryCatch);
+			}
+			policy->schedule(now);
+		};
+
+		//The timer lives inside the policy, so it has to close before the policy goes
+		void release() {
+			baton = NULL;
+			uv_timer_stop(&this->timer);
+			uv_close(reinterpret_cast<uv_handle_t*>(&this->timer), freePolicy);
+		};
+
+		static void freePolicy(uv_handle_t* handle) {
+			SignalPolicy* policy = static_cast<SignalPolicy*>(handle->data);
+			for (std::list<Pending>::iterator i = policy->pending.begin(); i != policy->pending.end(); ++i)
+				dbus_message_unref(i->message);
+			delete policy;
+		};
+	};
+
+	/**
+	 * Reads subscription options: { sender } restricts delivery to the
+	 * current owner of a name, the MessagePredicate fields narrow it down
+	 * further and any of { merge, debounce, rate } puts a SignalPolicy in
+	 * front of the callback.
+	 */
+	static void readString(Local<Object> object, const char* name, std::string& out) {
+		Local<Value> value = object->Get(String::NewSymbol(name));
+		if (value->IsString())
+			out = *String::Utf8Value(value);
+	};
+
+	static void parsePredicate(Local<Object> object, MessagePredicate& predicate) {
+		Local<Value> type = object->Get(String::NewSymbol("type")), arg0 = object->Get(String::NewSymbol("arg0"));
+		if (type->IsNumber())
+			predicate.type = type->Int32Value();
+		readString(object, "path", predicate.path);
+		readString(object, "interface", predicate.interface);
+		readString(object, "member", predicate.member);
+		readString(object, "signature", predicate.signature);
+		if ((predicate.hasArg0 = arg0->IsString()))
+			predicate.arg0 = *String::Utf8Value(arg0);
+	};
+
+	static void parseOptions(Handle<Value> options, ConnectionCallbackBaton* baton) {
+		if (!options->IsObject())
+			return;
+		Local<Object> object = options->ToObject();
+		Local<String> merge = String::NewSymbol("merge"), debounce = String::NewSymbol("debounce"), rate = String::NewSymbol("rate");
+		Local<Value> sender = object->Get(String::NewSymbol("sender"));
+
+		if (sender->IsString()) {
+			baton->sender = *String::Utf8Value(sender);
+			baton->connection->watchOwner(baton->sender);
+		}
+
+		parsePredicate(object, baton->predicate);
+
+		if (object->Has(merge) || object->Has(debounce) || object->Has(rate)) {
+			baton->policy = new SignalPolicy(baton, 
+				object->Get(merge)->BooleanValue(),
+				object->Get(debounce)->Uint32Value(),
+				object->Get(rate)->Uint32Value()
+			);
+		}
+	};
+
+	class DispatchBaton {
+	public:
+		DispatchBaton(DBusConnectionWrap* conn, uv_async_cb cb) : connection(conn) { 
+			uv_async_init(uv_default_loop(), &this->work, cb);
+			this->work.data = this;
+		};
+		DBusConnectionWrap* connection;
+		uv_async_t work;
+	};
+
+	DispatchBaton* dispatcher;
+
+	/**
+	 * Name owner tracking: owners maps each watched well-known name to its
+	 * unique owner ("" while unowned). It is seeded with one GetNameOwner
+	 * per name and kept current by a NameOwnerChanged match with an arg0
+	 * filter per name, so the bus only sends the changes that are watched;
+	 * they are picked up by ownerFilter, which runs from firstFilter ahead
+	 * of every other filter.
+	 */
+	struct OwnerChange {
+		std::string name;
+		std::string oldOwner;
+		std::string newOwner;
+	};
+
+	struct OwnerSeedBaton {
+		DBusConnectionWrap* connection;
+		std::string name;
+	};
+
+	std::set<std::string> watchedNames;
+	std::map<std::string, std::string> owners;
+	std::vector<OwnerChange> ownerChanges;
+	DispatchBaton* ownerNotifier;
+	Persistent<Function> ownerCallback;
+
+	void watchOwner(const std::string& name) {
+		if (name.empty() || name[0] == ':' || !watchedNames.insert(name).second)
+			return;
+		addMatch("type='signal',sender='" DBUS_SERVICE_DBUS "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',arg0='" + name + "'");
+		seedOwner(name);
+	};
+
+	void seedOwner(const std::string& name) {
+		DBusMessage* message;
+		DBusPendingCall* pending = NULL;
+		const char* value = name.c_str();
+
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "GetNameOwner");
+		if (!message)
+			return;
+		dbus_message_append_args(message, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID);
+		if (dbus_connection_send_with_reply(connection, message, &pending, -1) && pending) {
+			OwnerSeedBaton* baton = new OwnerSeedBaton();
+			baton->connection = this;
+			baton->name = name;
+			dbus_pending_call_set_notify(pending, ownerSeeded, baton, freeOwnerSeedBaton);
+			dbus_pending_call_unref(pending);
+		}
+		dbus_message_unref(message);
+	};
+
+	//True unless name has a known owner other than sender
+	bool fromOwner(const std::string& name, const char* sender) {
+		if (!sender)
+			return false;
+		if (name == sender)
+			return true;
+		std::map<std::string, std::string>::iterator found = owners.find(name);
+		return found == owners.end() || found->second == sender;
+	};
+
+	static void freeOwnerSeedBaton(void* data) {
+		delete static_cast<OwnerSeedBaton*>(data);
+	};
+
+	static void ownerSeeded(DBusPendingCall *pending, void *data) {
+		OwnerSeedBaton* baton = static_cast<OwnerSeedBaton*>(data);
+		DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+		const char* owner = NULL;
+
+		if (!reply)
+			return;
+		if (!baton->connection->connection) {
+			dbus_message_unref(reply);
+			return;
+		}
+		//A NameOwnerChanged that raced ahead of the reply is newer, keep it
+		if (!baton->connection->owners.count(baton->name)) {
+			if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+				dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID);
+			baton->connection->owners[baton->name] = owner ? owner : "";
+		}
+		dbus_message_unref(reply);
+	};
+
+	static DBusHandlerResult ownerFilter(DBusConnection* connection, DBusMessage* message, void* data) {
+		DBusConnectionWrap* wrap = static_cast<DBusConnectionWrap*>(data);
+		const char *name, *oldOwner, *newOwner;
+
+		if (wrap->watchedNames.empty() || !dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged") || 
+			!dbus_message_has_sender(message, DBUS_SERVICE_DBUS))
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+		if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID))
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+		if (wrap->watchedNames.count(name)) {
+			wrap->owners[name] = newOwner;
+			if (!wrap->ownerCallback.IsEmpty()) {
+				OwnerChange change;
+				change.name = name;
+				change.oldOwner = oldOwner;
+				change.newOwner = newOwner;
+				wrap->ownerChanges.push_back(change);
+				uv_async_send(&wrap->ownerNotifier->work);
+			}
+		}
+		//Everyone else still gets to see the signal
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	};
+
+	static void notifyOwners(uv_async_t* work, int status) {
+		DBusConnectionWrap* wrap = static_cast<DispatchBaton*>(work->data)->connection;
+		std::vector<OwnerChange> changes;
+		HandleScope scope;
+
+		changes.swap(wrap->ownerChanges);
+		for (size_t i = 0; i < changes.size() && !wrap->ownerCallback.IsEmpty(); ++i) {
+			TryCatch tryCatch;
+			Handle<Value> argv[3] = { 
+				String::New(changes[i].name.c_str()), 
+				changes[i].oldOwner.empty() ? Handle<Value>(Null()) : Handle<Value>(String::New(changes[i].oldOwner.c_str())), 
+				changes[i].newOwner.empty() ? Handle<Value>(Null()) : Handle<Value>(String::New(changes[i].newOwner.c_str()))
+			};
+			wrap->ownerCallback->Call(Context::GetCurrent()->Global(), 3, argv);
+			if (tryCatch.HasCaught())
+				FatalException(tryCatch);
+		}
+	};
+
+	/**
+	 * Monitor
+	 * After becomeMonitor the connection sees all traffic on the bus. Every
+	 * message is taken by firstFilter before object paths or other filters
+	 * get a look, marshalled into the capture buffer if there is a capture
+	 * file and kept in a ring of the last capacity messages until JS drains
+	 * it; nothing is decoded until a drained message is asked for its
+	 * fields. The capture buffer is written out from notifyMonitor, once
+	 * per turn of the loop, never from inside dispatch. Nothing is taken
+	 * until the bus has accepted BecomeMonitor (active).
+	 */
+	struct Monitor {
+		Monitor(size_t c, FILE* f) : messages(new DBusMessage*[c ? c : 1]), capacity(c), head(0), count(0), dropped(0), file(f), active(false) { };
+		~Monitor() {
+			while (count > 0)
+				dbus_message_unref(shift());
+			delete [] messages;
+			if (file) {
+				fwrite(buffered.data(), 1, buffered.size(), file);
+				fclose(file);
+			}
+			if (!callback.IsEmpty())
+				callback.Dispose();
+		};
+
+		DBusMessage* shift() {
+			DBusMessage* message = messages[head];
+			head = (head + 1) % capacity;
+			--count;
+			return message;
+		};
+
+		void push(DBusMessage* message) {
+			//Oldest first out when JS falls behind
+			if (count == capacity) {
+				dbus_message_unref(shift());
+				++dropped;
+			}
+			messages[(head + count) % capacity] = dbus_message_ref(message);
+			++count;
+		};
+
+		DBusMessage** messages;
+		size_t capacity;
+		size_t head;
+		size_t count;
+		unsigned long dropped;
+		FILE* file;
+		//Marshalled messages not written to file yet
+		std::string buffered;
+		bool active;
+		//Why the bus refused BecomeMonitor, for notifyMonitor to report
+		std::string error;
+		Persistent<Function> callback;
+	};
+
+	Monitor* monitor;
+	DispatchBaton* monitorNotifier;
+
+	static DBusHandlerResult capture(DBusConnectionWrap* wrap, DBusMessage* message) {
+		Monitor* monitor = wrap->monitor;
+
+		if (monitor->file) {
+			char* blob = NULL;
+			int length = 0;
+			//A loop too busy to write leaves the rest out rather than growing without bound
+			if (monitor->buffered.size() >= DBUS_CAPTURE_BUFFER_LIMIT)
+				++monitor->dropped;
+			else if (dbus_message_marshal(message, &blob, &length)) {
+				monitor->buffered.append(blob, length);
+				dbus_free(blob);
+			}
+		}
+		if (monitor->capacity > 0)
+			monitor->push(message);
+		uv_async_send(&wrap->monitorNotifier->work);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	};
+
+	static void unrefConnection(void* data) {
+		static_cast<DBusConnectionWrap*>(data)->Unref();
+	};
+
+	static void monitorStarted(DBusPendingCall *pending, void *data) {
+		DBusConnectionWrap* wrap = static_cast<DBusConnectionWrap*>(data);
+		DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+		const char* text = "No reply to BecomeMonitor";
+		Monitor* monitor = wrap->monitor;
+
+		//Gone with close(), or already settled by becomeMonitor itself
+		if (!monitor || monitor->active || !monitor->error.empty()) {
+			if (reply)
+				dbus_message_unref(reply);
+			return;
+		}
+		if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+			monitor->active = true;
+		else {
+			if (reply && !dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &text, DBUS_TYPE_INVALID))
+				text = dbus_message_get_error_name(reply);
+			monitor->error = text ? text : "BecomeMonitor failed";
+			uv_async_send(&wrap->monitorNotifier->work);
+		}
+		if (reply)
+			dbus_message_unref(reply);
+	};
+
+	//Installed ahead of every other filter: feeds the monitor, then owner tracking, then relays
+	static DBusHandlerResult firstFilter(DBusConnection* connection, DBusMessage* message, void* data) {
+		DBusConnectionWrap* wrap = static_cast<DBusConnectionWrap*>(data);
+		if (dbus_message_is_signal(message, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+			//Not from in here: the connection is swapped out once dispatch has returned
+			if (wrap->reconnectTimer && !wrap->disconnectedAt) {
+				wrap->disconnectedAt = uv_hrtime();
+				wrap->reconnectAttempts = 0;
+				wrap->reconnectBackoff = wrap->reconnectDelay;
+				uv_timer_start(wrap->reconnectTimer, reconnect, 0, 0);
+			}
+		}
+		else if (wrap->monitor && wrap->monitor->active)
+			return capture(wrap, message);
+		DBusHandlerResult result = ownerFilter(connection, message, data);
+		if (result == DBUS_HANDLER_RESULT_NOT_YET_HANDLED && !wrap->relays.empty())
+			return wrap->relayMessage(message);
+		return result;
+	};
+
+	static void notifyMonitor(uv_async_t* work, int status) {
+		DBusConnectionWrap* wrap = static_cast<DispatchBaton*>(work->data)->connection;
+		Monitor* monitor = wrap->monitor;
+		HandleScope scope;
+		TryCatch tryCatch;
+
+		if (!monitor)
+			return;
+
+		if (!monitor->buffered.empty()) {
+			fwrite(monitor->buffered.data(), 1, monitor->buffered.size(), monitor->file);
+			fflush(monitor->file);
+			monitor->buffered.clear();
+		}
+
+		//A refused monitor is taken down again, so becomeMonitor can be retried
+		if (!monitor->error.empty()) {
+			Persistent<Function> callback = monitor->callback;
+			Handle<Value> argv[1] = { Exception::Error(String::New(monitor->error.c_str())) };
+			monitor->callback.Clear();
+			delete monitor;
+			wrap->monitor = NULL;
+			callback->Call(Context::GetCurrent()->Global(), 1, argv);
+			callback.Dispose();
+		}
+		else if (monitor->count > 0 && !monitor->callback.IsEmpty())
+			monitor->callback->Call(Context::GetCurrent()->Global(), 0, NULL);
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
+	};
+
+	/**
+	 * Delivery lanes
+	 * Everything bound for JS is queued on a lane and handed over from one
+	 * async handle per connection: replies and errors to our own calls
+	 * first, then calls to exported objects, then signals. Each lane has a
+	 * per-turn budget and leftovers wait for the next turn of the loop, so
+	 * a signal storm can hold up signals but not replies.
+	 */
+	enum Lane { LANE_REPLY, LANE_CALL, LANE_SIGNAL, LANE_COUNT };
+
+	struct Delivery {
+		ConnectionCallbackBaton* callbackBaton;
+		//A message for filters and object paths, a pending call for replies
+		DBusMessage* message;
+		DBusPendingCall* pending;
+	};
+
+	std::deque<Delivery> lanes[LANE_COUNT];
+	unsigned int laneBudget[LANE_COUNT];
+	DispatchBaton* deliverer;
+
+	/**
+	 * Inbound flow control
+	 * With more than inboundHighWaterMark deliveries queued the connection
+	 * is paused: read watches are taken off the loop and dispatching stops,
+	 * so further traffic backs up in libdbus, the socket and the daemon
+	 * rather than on our heap. Below half the mark it picks up again. JS
+	 * hears of both through flowCallback(paused), from deliver().
+	 * Signals a SignalPolicy is holding back are not counted: they wait on
+	 * a timer rather than on JS, so pausing for them would only hold up
+	 * replies for a debounce period, and each policy is already bounded by
+	 * SIGNAL_POLICY_LIMIT.
+	 */
+	size_t queued;
+	size_t inboundHighWaterMark;
+	bool paused;
+	bool reportedPaused;
+	Persistent<Function> flowCallback;
+	std::set<WatchBaton*> watches;
+
+	/**
+	 * Calls still waiting for their reply to be delivered, by serial, so
+	 * they can be cancelled; the baton holds the pending call reference
+	 * send_with_reply gave us.
+	 */
+	std::map<dbus_uint32_t, ConnectionCallbackBaton*> pendingCalls;
+
+	//Returns whether serial was still outstanding
+	bool cancelCall(dbus_uint32_t serial) {
+		std::map<dbus_uint32_t, ConnectionCallbackBaton*>::iterator found = pendingCalls.find(serial);
+		if (found == pendingCalls.end())
+			return false;
+
+		ConnectionCallbackBaton* baton = found->second;
+		pendingCalls.erase(found);
+		if (dbus_pending_call_get_completed(baton->pending)) {
+			//Already on the reply lane; it is dropped there instead
+			baton->cancelled = true;
+			return true;
+		}
+		//Frees the baton, and the callback with it, right away
+		dbus_pending_call_cancel(baton->pending);
+		dbus_pending_call_unref(baton->pending);
+		return true;
+	};
+
+	void cancelCalls() {
+		while (!pendingCalls.empty())
+			cancelCall(pendingCalls.begin()->first);
+	};
+
+	/**
+	 * Relays
+	 * Messages matching a relay rule are copied onto the target connection
+	 * from firstFilter, headers rewritten as the rule asks, and never reach
+	 * JS. A relayed method call gets a pending call of its own on the
+	 * target; its reply is copied back with the serial of the original
+	 * call and addressed to its sender, so serials need no mapping table.
+	 */
+	struct RelayRule {
+		MessagePredicate predicate;
+		std::string sender;
+		//Header rewrites; empty leaves the header alone
+		std::string destination;
+		std::string path;
+		//Bus match rule added for signals, so the bus routes them to us
+		std::string match;
+	};
+
+	class Relay {
+	public:
+		Relay(unsigned int i, DBusConnectionWrap* t, int ms) : id(i), target(t), timeout(ms), forwarded(0) { };
+		unsigned int id;
+		DBusConnectionWrap* target;
+		int timeout;
+		std::vector<RelayRule> rules;
+		double forwarded;
+	};
+
+	class RelayReply {
+	public:
+		RelayReply(DBusConnectionWrap* s, const char* from, dbus_uint32_t n) : source(s), sender(from ? from : ""), serial(n) { };
+		DBusConnectionWrap* source;
+		std::string sender;
+		dbus_uint32_t serial;
+	};
+
+	static unsigned int lastRelay;
+	std::list<Relay*> relays;
+
+	DBusHandlerResult relayMessage(DBusMessage* message) {
+		const char* sender = dbus_message_get_sender(message);
+		for (std::list<Relay*>::iterator i = relays.begin(); i != relays.end(); ++i) {
+			Relay* relay = *i;
+			//A closed target lets its traffic fall through to JS again
+			if (!relay->target->connection)
+				continue;
+			for (size_t r = 0; r < relay->rules.size(); ++r) {
+				const RelayRule& rule = relay->rules[r];
+				if (!rule.predicate.matches(message) || (!rule.sender.empty() && !fromOwner(rule.sender, sender)))
+					continue;
+				forward(relay, rule, message);
+				return DBUS_HANDLER_RESULT_HANDLED;
+			}
+		}
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	};
+
+	void forward(Relay* relay, const RelayRule& rule, DBusMessage* message) {
+		DBusPendingCall* pending = NULL;
+		//The copy is unlocked and has no serial, so the target numbers it
+		DBusMessage* copy = dbus_message_copy(message);
+		if (!copy)
+			return;
+		dbus_message_set_sender(copy, NULL);
+		if (!rule.destination.empty())
+			dbus_message_set_destination(copy, rule.destination.c_str());
+		if (!rule.path.empty())
+			dbus_message_set_path(copy, rule.path.c_str());
+		relay->forwarded++;
+
+		if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL || dbus_message_get_no_reply(message)) {
+			dbus_connection_send(*relay->target, copy, NULL);
+		}
+		else if (dbus_connection_send_with_reply(*relay->target, copy, &pending, relay->timeout) && pending) {
+			RelayReply* reply = new RelayReply(this, dbus_message_get_sender(message), dbus_message_get_serial(message));
+			Ref();
+			if (!dbus_pending_call_set_notify(pending, relayReplied, reply, freeRelayReply)) {
+				freeRelayReply(reply);
+				dbus_pending_call_cancel(pending);
+			}
+			dbus_pending_call_unref(pending);
+		}
+		else {
+			DBusMessage* error = dbus_message_new_error(message, DBUS_ERROR_DISCONNECTED, "Relay target is not connected");
+			if (error) {
+				dbus_connection_send(connection, error, NULL);
+				dbus_message_unref(error);
+			}
+		}
+		dbus_message_unref(copy);
+	};
+
+	//Replies (timeouts included, which libdbus makes up itself) go back the way the call came
+	static void relayReplied(DBusPendingCall* pending, void* data) {
+		RelayReply* reply = static_cast<RelayReply*>(data);
+		DBusMessage* message = dbus_pending_call_steal_reply(pending);
+		if (!message)
+			return;
+		DBusMessage* copy = reply->source->connection ? dbus_message_copy(message) : NULL;
+		if (copy) {
+			dbus_message_set_sender(copy, NULL);
+			dbus_message_set_reply_serial(copy, reply->serial);
+			dbus_message_set_destination(copy, reply->sender.empty() ? NULL : reply->sender.c_str());
+			dbus_connection_send(*reply->source, copy, NULL);
+			dbus_message_unref(copy);
+		}
+		dbus_message_unref(message);
+	};
+
+	static void freeRelayReply(void* data) {
+		RelayReply* reply = static_cast<RelayReply*>(data);
+		reply->source->Unref();
+		delete reply;
+	};
+
+	//Bus match rule for a signal relay rule; empty on peer connections
+	std::string matchFor(const RelayRule& rule) {
+		const MessagePredicate& predicate = rule.predicate;
+		std::string match = "type='signal'";
+		if (!dbus_bus_get_unique_name(connection) || (predicate.type != DBUS_MESSAGE_TYPE_INVALID && predicate.type != DBUS_MESSAGE_TYPE_SIGNAL))
+			return "";
+		if (!rule.sender.empty())
+			match += ",sender='" + rule.sender + "'";
+		if (!predicate.path.empty())
+			match += ",path_namespace='" + predicate.path + "'";
+		if (!predicate.interface.empty())
+			match += ",interface='" + predicate.interface + "'";
+		if (!predicate.member.empty())
+			match += ",member='" + predicate.member + "'";
+		if (predicate.hasArg0)
+			match += ",arg0='" + predicate.arg0 + "'";
+		return match;
+	};
+
+	void removeRelay(std::list<Relay*>::iterator i) {
+		Relay* relay = *i;
+		for (size_t r = 0; r < relay->rules.size(); ++r) {
+			if (!relay->rules[r].match.empty())
+				removeMatch(relay->rules[r].match);
+		}
+		relay->target->Unref();
+		relays.erase(i);
+		delete relay;
+	};
+
+	/**
+	 * Reconnecting
+	 * Everything this wrapper set up on its connection is remembered:
+	 * filters, object paths, match rules and requested names, along with
+	 * how the connection was made. With reconnecting on, a Disconnected
+	 * signal swaps in a fresh DBusConnection under the same wrapper and
+	 * the whole lot is replayed in one batch, none of it waiting on a
+	 * reply, so JS objects and subscriptions never notice. Until then the
+	 * dead connection stays attached: sends fail cleanly on it.
+	 */
+	int busType;
+	std::string address;
+	std::vector<ConnectionCallbackBaton*> filters;
+	std::map<std::string, ConnectionCallbackBaton*> objectPaths;
+	std::multiset<std::string> matches;
+	std::map<std::string, int> requestedNames;
+	uv_timer_t* reconnectTimer;
+	unsigned int reconnectDelay;
+	unsigned int reconnectMaxDelay;
+	unsigned int reconnectBackoff;
+	unsigned int reconnectAttempts;
+	uint64_t disconnectedAt;
+	Persistent<Function> reconnectCallback;
+
+	void addMatch(const std::string& rule) {
+		matches.insert(rule);
+		//No error argument: the match is added without blocking for the reply
+		if (connection)
+			dbus_bus_add_match(connection, rule.c_str(), NULL);
+	};
+
+	bool removeMatch(const std::string& rule) {
+		std::multiset<std::string>::iterator found = matches.find(rule);
+		if (found == matches.end())
+			return false;
+		matches.erase(found);
+		if (connection)
+			dbus_bus_remove_match(connection, rule.c_str(), NULL);
+		return true;
+	};
 
-class DBusConnectionWrap : ObjectWrap {
-public:
+	//Drops the remembered filters and object paths; libdbus still holds its own references
+	void forget() {
+		for (size_t i = 0; i < filters.size(); ++i)
+			releaseBaton(filters[i]);
+		filters.clear();
+		for (std::map<std::string, ConnectionCallbackBaton*>::iterator i = objectPaths.begin(); i != objectPaths.end(); ++i)
+			releaseBaton(i->second);
+		objectPaths.clear();
+	};
 
-	static Persistent<FunctionTemplate> constructorTemplate;
+	void stopReconnecting() {
+		if (!reconnectTimer)
+			return;
+		uv_timer_stop(reconnectTimer);
+		uv_close(reinterpret_cast<uv_handle_t*>(reconnectTimer), freeTimer);
+		reconnectTimer = NULL;
+		disconnectedAt = 0;
+	};
 
-	DBusConnection* connection;
-	bool priv;
-	
-	
-	DBusConnectionWrap(DBusConnection* c, bool p) : ObjectWrap(), connection(c), priv(p) {
-		
+	DBusConnection* connect(DBusError* error) {
+		DBusConnection* fresh;
+		if (busType < 0)
+			return priv ? dbus_connection_open_private(address.c_str(), error) : dbus_connection_open(address.c_str(), error);
+		fresh = priv ? dbus_bus_get_private(DBusBusType(busType), error) : dbus_bus_get(DBusBusType(busType), error);
+		if (fresh)
+			dbus_connection_set_exit_on_disconnect(fresh, false);
+		return fresh;
 	};
-	
-	~DBusConnectionWrap() {
-		
-		printf("dtor");
+
+	//Registers everything remembered on the current connection; the bus calls are only queued
+	void replay() {
+		for (size_t i = 0; i < filters.size(); ++i) {
+			if (dbus_connection_add_filter(connection, handleMessage, filters[i], releaseBaton))
+				filters[i]->refs++;
+		}
+		for (std::map<std::string, ConnectionCallbackBaton*>::iterator i = objectPaths.begin(); i != objectPaths.end(); ++i) {
+			if (dbus_connection_try_register_object_path(connection, i->first.c_str(), &objectPathVTable, i->second, NULL))
+				i->second->refs++;
+		}
+
+		if (busType < 0)
+			return;
+		for (std::multiset<std::string>::iterator i = matches.begin(); i != matches.end(); ++i)
+			dbus_bus_add_match(connection, i->c_str(), NULL);
+		//Outcomes show up as NameAcquired and NameOwnerChanged, not as replies
+		for (std::map<std::string, int>::iterator i = requestedNames.begin(); i != requestedNames.end(); ++i) {
+			DBusMessage* message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "RequestName");
+			const char* name = i->first.c_str();
+			dbus_uint32_t flags = i->second;
+			if (!message)
+				continue;
+			dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_UINT32, &flags, DBUS_TYPE_INVALID);
+			dbus_message_set_no_reply(message, TRUE);
+			dbus_connection_send(connection, message, NULL);
+			dbus_message_unref(message);
+		}
+		//Owners may all have changed while we were away; their matches went back above
+		owners.clear();
+		for (std::set<std::string>::iterator i = watchedNames.begin(); i != watchedNames.end(); ++i)
+			seedOwner(*i);
 	};
-	
-	operator DBusConnection* () const {
-		return connection;
+
+	void reportReconnect(const char* event) {
+		HandleScope scope;
+		TryCatch tryCatch;
+		if (reconnectCallback.IsEmpty())
+			return;
+		Handle<Value> argv[3] = { String::NewSymbol(event), Integer::NewFromUnsigned(reconnectAttempts), Number::New((uv_hrtime() - disconnectedAt) / 1e6) };
+		reconnectCallback->Call(Context::GetCurrent()->Global(), 3, argv);
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
 	};
 
+	static void reconnect(uv_timer_t* timer, int status) {
+		DBusConnectionWrap* wrap = static_cast<DBusConnectionWrap*>(timer->data);
+		DBusConnection* fresh;
+		DBusError error;
 
-	static void Init(Handle<Object> target) {
-		
-		Local<FunctionTemplate> t = FunctionTemplate::New(New);
-		constructorTemplate = Persistent<FunctionTemplate>::New(t);
-		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
-		constructorTemplate->SetClassName(String::NewSymbol("DBusConnection"));
+		if (wrap->reconnectAttempts == 0) {
+			wrap->reportReconnect("disconnect");
+			//The callback may have closed us or turned reconnecting off
+			if (wrap->reconnectTimer != timer)
+				return;
+		}
 
-		NODE_SET_METHOD(target, "open", open);
-		NODE_SET_METHOD(target, "get", get);
+		wrap->reconnectAttempts++;
+		dbus_error_init(&error);
+		if (!(fresh = wrap->connect(&error))) {
+			dbus_error_free(&error);
+			uv_timer_start(timer, reconnect, wrap->reconnectBackoff, 0);
+			wrap->reconnectBackoff = wrap->reconnectBackoff * 2 > wrap->reconnectMaxDelay ? wrap->reconnectMaxDelay : wrap->reconnectBackoff * 2;
+			wrap->reportReconnect("retry");
+			return;
+		}
 
-		NODE_SET_PROTOTYPE_METHOD(t, "close", close);
-		NODE_SET_PROTOTYPE_METHOD(t, "requestName", requestName);
+		//The dead connection stays attached until now, so nothing ever sees a NULL one
+		wrap->detach();
+		wrap->attach(fresh);
+		wrap->replay();
+		dispatchStatus(fresh, dbus_connection_get_dispatch_status(fresh), wrap);
+		wrap->reportReconnect("reconnect");
+		wrap->disconnectedAt = 0;
+	};
 
-		//NODE_SET_PROTOTYPE_METHOD(t, "close", close);
-		NODE_SET_PROTOTYPE_METHOD(t, "canSendType", canSendType);
-		
-		NODE_SET_PROTOTYPE_METHOD(t, "addFilter", addFilter);
-		//NODE_SET_PROTOTYPE_METHOD(t, "removeFilter", removeFilter);
+	//A queued delivery holds a reference, so unregistering or closing cannot free the baton under it
+	void enqueue(Lane lane, ConnectionCallbackBaton* callbackBaton, DBusMessage* message, DBusPendingCall* pending) {
+		Delivery delivery = { callbackBaton, message, pending };
+		callbackBaton->refs++;
+		lanes[lane].push_back(delivery);
+		if (++queued > inboundHighWaterMark && inboundHighWaterMark > 0 && !paused)
+			setPaused(true);
+		uv_async_send(&deliverer->work);
+	};
 
-		NODE_SET_PROTOTYPE_METHOD(t, "registerObjectPath", registerObjectPath);
-		NODE_SET_PROTOTYPE_METHOD(t, "unregisterObjectPath", unregisterObjectPath);
+	void setPaused(bool value) {
+		paused = value;
+		for (std::set<WatchBaton*>::iterator i = watches.begin(); i != watches.end(); ++i)
+			configureWatch((*i)->watch);
+		//Pick up whatever libdbus read while we were paused
+		if (!paused && dispatcher)
+			uv_async_send(&dispatcher->work);
+	};
 
-		NODE_SET_PROTOTYPE_METHOD(t, "send", send);
+	void reportFlow() {
+		if (paused == reportedPaused || flowCallback.IsEmpty())
+			return;
+		reportedPaused = paused;
 
-		NODE_SET_GETTER(t, "isConnected", isConnected);
-		NODE_SET_GETTER(t, "isAuthenticated", isAuthenticated);
-		NODE_SET_GETTER(t, "isAnonymous", isAnonymous);
-		NODE_SET_GETTER(t, "serverId", serverId);
-		
+		HandleScope scope;
+		TryCatch tryCatch;
+		Handle<Value> argv[1] = { Boolean::New(paused) };
+		flowCallback->Call(Context::GetCurrent()->Global(), 1, argv);
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
 	};
 
-	class ConnectionCallbackBaton {
-	public:
-		ConnectionCallbackBaton(Persistent<Function> cb, DBusConnectionWrap* conn) : callback(cb), connection(conn) { };
-		~ConnectionCallbackBaton() { /*callback.Dispose();*/ };
-		Persistent<Function> callback;
-		DBusConnectionWrap* connection;
-	};
+	static void deliver(uv_async_t* work, int status) {
+		DBusConnectionWrap* wrap = static_cast<DispatchBaton*>(work->data)->connection;
+		bool more = false;
+
+		wrap->reportFlow();
+		for (int lane = 0; lane < LANE_COUNT; ++lane) {
+			std::deque<Delivery>& queue = wrap->lanes[lane];
+			for (unsigned int n = 0; n < wrap->laneBudget[lane] && !queue.empty(); ++n) {
+				Delivery delivery = queue.front();
+				queue.pop_front();
+				--wrap->queued;
+				if (delivery.pending)
+					deliverReply(delivery);
+				else
+					deliverMessage(delivery);
+				releaseBaton(delivery.callbackBaton);
+			}
+			more = more || !queue.empty();
+		}
 
-	class DispatchBaton {
-	public:
-		DispatchBaton(DBusConnectionWrap* conn, uv_async_cb cb) : connection(conn) { 
-			uv_async_init(uv_default_loop(), &this->work, cb);
-			this->work.data = this;
-		};
-		DBusConnectionWrap* connection;
-		uv_async_t work;
+		if (wrap->paused && wrap->queued <= wrap->inboundHighWaterMark / 2)
+			wrap->setPaused(false);
+		wrap->reportFlow();
+
+		//The handle may have been closed by a callback
+		if (more && wrap->deliverer)
+			uv_async_send(&wrap->deliverer->work);
 	};
 
-	template<class T> class ConnectionCallbackWorkBaton {
-	public:
-		ConnectionCallbackWorkBaton(ConnectionCallbackBaton* c, T d, uv_async_cb cb) : callbackBaton(c), data(d) { 
-			uv_async_init(uv_default_loop(), &this->work, cb);
-			this->work.data = this;
-		};
-		~ConnectionCallbackWorkBaton() { };
-		ConnectionCallbackBaton* callbackBaton;
-		T data;
-		uv_async_t work;
+	//Drops whatever never made it to JS; the connection is going away
+	void discardDeliveries() {
+		for (int lane = 0; lane < LANE_COUNT; ++lane) {
+			for (size_t i = 0; i < lanes[lane].size(); ++i) {
+				if (lanes[lane][i].pending)
+					dbus_pending_call_unref(lanes[lane][i].pending);
+				else
+					dbus_message_unref(lanes[lane][i].message);
+				releaseBaton(lanes[lane][i].callbackBaton);
+			}
+			lanes[lane].clear();
+		}
+		queued = 0;
+	};
 
+	static void freeDispatchBaton(uv_handle_t* handle) {
+		delete static_cast<DispatchBaton*>(handle->data);
 	};
 
 	static Handle<Value> New(const Arguments &args) {
@@ -712,11 +3444,100 @@ public:
 		return args.This();
 	};
 
+	//Lets go of the DBusConnection but keeps everything needed to attach another one
+	/**
+	 * Every wrapper attached to each DBusConnection. dbus.get() without
+	 * priv hands out libdbus's shared connection, which can only have one
+	 * set of watch, timeout and dispatch functions: the wrapper at the
+	 * front of the list drives it, and the next one takes over when it
+	 * detaches. The functions are only removed along with the last one.
+	 */
+	static std::map< DBusConnection*, std::list<DBusConnectionWrap*> > attached;
+
+	void drive() {
+		dbus_connection_set_dispatch_status_function(connection, dispatchStatus, this, NULL);
+		dbus_connection_set_watch_functions(connection, addWatch, removeWatch, watchToggled, this, NULL);
+		dbus_connection_set_timeout_functions(connection, addTimeout, removeTimeout, timeoutToggled, this, NULL);
+		dispatchStatus(connection, dbus_connection_get_dispatch_status(connection), this);
+	};
+
+	void detach() {
+		std::list<DBusConnectionWrap*>& users = attached[connection];
+
+		//A shared connection outlives this wrapper, so stop it calling back into us
+		dbus_connection_remove_filter(connection, firstFilter, this);
+		users.remove(this);
+		if (users.empty()) {
+			attached.erase(connection);
+			dbus_connection_set_dispatch_status_function(connection, NULL, NULL, NULL);
+			dbus_connection_set_watch_functions(connection, NULL, NULL, NULL, NULL, NULL);
+			dbus_connection_set_timeout_functions(connection, NULL, NULL, NULL, NULL, NULL);
+		}
+		else if (users.front()->dispatcher) {
+			users.front()->drive();
+		}
+
+		if (priv &&  dbus_connection_get_is_connected(connection))
+			dbus_connection_close(connection);
+		dbus_connection_unref(connection);
+		connection = NULL;
+	};
+
+	void attach(DBusConnection* c) {
+		std::list<DBusConnectionWrap*>& users = attached[c];
+
+		connection = c;
+		//First filter on the connection, so no user filter can swallow owner changes or monitored traffic
+		dbus_connection_add_filter(connection, firstFilter, this, NULL);
+		users.push_back(this);
+		if (users.front() == this)
+			drive();
+	};
+
+	//Takes this wrapper's filters, object paths and matches off a connection that others may go on using
+	void unregisterAll() {
+		for (size_t i = 0; i < filters.size(); ++i)
+			dbus_connection_remove_filter(connection, handleMessage, filters[i]);
+		for (std::map<std::string, ConnectionCallbackBaton*>::iterator i = objectPaths.begin(); i != objectPaths.end(); ++i)
+			dbus_connection_unregister_object_path(connection, i->first.c_str());
+		if (dbus_connection_get_is_connected(connection)) {
+			for (std::multiset<std::string>::iterator i = matches.begin(); i != matches.end(); ++i)
+				dbus_bus_remove_match(connection, i->c_str(), NULL);
+		}
+		matches.clear();
+	};
+
 	static Handle<Value> close(const Arguments &args) {
 		DBusConnectionWrap* connection = THIS_CONNECTION(args);
-		if (connection->priv &&  dbus_connection_get_is_connected(*connection))
-			dbus_connection_close(*connection);
-		dbus_connection_unref(*connection);
+		//The dispatcher lives as long as the wrapper is open, connected or not
+		if (!connection->dispatcher)
+			return Undefined();
+
+		connection->stopReconnecting();
+		connection->cancelCalls();
+		while (!connection->relays.empty())
+			connection->removeRelay(connection->relays.begin());
+		if (connection->connection)
+			connection->unregisterAll();
+		connection->forget();
+		if (connection->connection)
+			connection->detach();
+
+		uv_close(reinterpret_cast<uv_handle_t*>(&connection->dispatcher->work), freeDispatchBaton);
+		connection->dispatcher = NULL;
+		uv_close(reinterpret_cast<uv_handle_t*>(&connection->ownerNotifier->work), freeDispatchBaton);
+		connection->ownerNotifier = NULL;
+		uv_close(reinterpret_cast<uv_handle_t*>(&connection->deliverer->work), freeDispatchBaton);
+		connection->deliverer = NULL;
+		connection->discardDeliveries();
+		if (connection->monitorNotifier) {
+			uv_close(reinterpret_cast<uv_handle_t*>(&connection->monitorNotifier->work), freeDispatchBaton);
+			connection->monitorNotifier = NULL;
+		}
+		delete connection->monitor;
+		connection->monitor = NULL;
+		connection->Unref();
+		return Undefined();
 	};
 
 
@@ -724,60 +3545,80 @@ public:
 	static void dispatch(uv_async_t* work, int status) {
 		DispatchBaton* baton = static_cast<DispatchBaton*>(work->data);
 		DBusConnection* connection = *baton->connection;
-		while(dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS);
-		//delete baton;
+		if (!connection)
+			return;
+		//Paused connections leave messages in libdbus until JS catches up
+		while(!baton->connection->paused && dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS);
 	}
 
 	static void dispatchStatus(DBusConnection *connection, DBusDispatchStatus status, void *data) {
 		DBusConnectionWrap* wrap = ((DBusConnectionWrap*)data);
-		if (status == DBUS_DISPATCH_DATA_REMAINS) {
-			DispatchBaton* baton = new DispatchBaton(wrap, dispatch);
-			uv_async_send(&baton->work);
-		}
+		//One async handle per connection; libuv coalesces repeated sends
+		if (status == DBUS_DISPATCH_DATA_REMAINS)
+			uv_async_send(&wrap->dispatcher->work);
+	};
+
+	class WatchBaton {
+	public:
+		WatchBaton(DBusWatch* w, DBusConnectionWrap* conn) : watch(w), connection(conn) {
+			ev_init(&this->io, watchCallback);
+			this->io.data = this;
+		};
+		ev_io io;
+		DBusWatch* watch;
+		DBusConnectionWrap* connection;
 	};
 
 	static void freeWatchData(void* data) {
-		ev_io* io = static_cast<ev_io*>(data);
-		delete io;
+		WatchBaton* baton = static_cast<WatchBaton*>(data);
+		ev_io_stop(ev_default_loop(0), &baton->io);
+		delete baton;
 	};
 
 	static void watchCallback(struct ev_loop *loop, ev_io *io, int events) {
-		DBusWatch *watch = static_cast<DBusWatch*>(io->data);
-		int flags = dbus_watch_get_flags(watch);
-		while (!dbus_watch_handle(watch, 
+		WatchBaton* baton = static_cast<WatchBaton*>(io->data);
+		while (!dbus_watch_handle(baton->watch, 
 			(events & EV_READ ? DBUS_WATCH_READABLE : 0) | 
 			(events & EV_WRITE ? DBUS_WATCH_WRITABLE : 0) |
 			(events & EV_ERROR ? DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP : 0)
 			)
 		);
+		if (events & EV_WRITE)
+			checkDrain(baton->connection);
 	}
 
+	//libev watchers cannot be changed while they are running
 	static void configureWatch(DBusWatch *watch) {
-		ev_io* io = static_cast<ev_io*>(dbus_watch_get_data(watch));
+		WatchBaton* baton = static_cast<WatchBaton*>(dbus_watch_get_data(watch));
+		int flags = dbus_watch_get_flags(watch);
+		//A paused connection keeps writing but reads nothing
+		if (baton->connection->paused)
+			flags &= ~DBUS_WATCH_READABLE;
+		ev_io_stop(ev_default_loop(0), &baton->io);
+		if (!(flags & (DBUS_WATCH_READABLE | DBUS_WATCH_WRITABLE)))
+			return;
 		if (dbus_watch_get_enabled(watch)) {
-			int flags = dbus_watch_get_flags(watch);
-			ev_io_set(io, dbus_watch_get_socket(watch), 
+			ev_io_set(&baton->io, dbus_watch_get_unix_fd(watch), 
 				(flags & DBUS_WATCH_READABLE ? EV_READ : 0) | 
 				(flags & DBUS_WATCH_WRITABLE ? EV_WRITE : 0)
 			);
-		}
-		else {
-			ev_io_set(io, dbus_watch_get_unix_fd(watch), 0);
+			ev_io_start(ev_default_loop(0), &baton->io);
 		}
 	}
 	
 	static dbus_bool_t addWatch(DBusWatch *watch, void *data) {
-		ev_io* io = new ev_io();
-		ev_io_init(io, watchCallback, dbus_watch_get_unix_fd(watch), EV_READ | EV_WRITE);
-		io->data = watch;
-		dbus_watch_set_data(watch, io, freeWatchData);
+		WatchBaton* baton = new WatchBaton(watch, static_cast<DBusConnectionWrap*>(data));
+		dbus_watch_set_data(watch, baton, freeWatchData);
+		baton->connection->watches.insert(baton);
 		configureWatch(watch);
-		ev_io_start(ev_default_loop(0), io);
 		return true;
 	};
 	
+	//libdbus always removes a watch before freeing it
 	static void removeWatch(DBusWatch *watch, void *data) {
-		ev_io_stop(ev_default_loop(0), static_cast<ev_io*>(dbus_watch_get_data(watch)));
+		WatchBaton* baton = static_cast<WatchBaton*>(dbus_watch_get_data(watch));
+		baton->connection->watches.erase(baton);
+		ev_io_stop(ev_default_loop(0), &baton->io);
 	};
 	
 	static void watchToggled(DBusWatch *watch, void *data) {
@@ -786,9 +3627,14 @@ public:
 
 
 
+	static void freeTimer(uv_handle_t* handle) {
+		delete reinterpret_cast<uv_timer_t*>(handle);
+	};
+
 	static void freeTimeoutData(void* data) {
 		uv_timer_t* timer = static_cast<uv_timer_t*>(data);
-		//delete timer;
+		uv_timer_stop(timer);
+		uv_close(reinterpret_cast<uv_handle_t*>(timer), freeTimer);
 	};
 
 	static void timerCallback(uv_timer_t* timer, int status) {
@@ -818,175 +3664,678 @@ public:
 		uv_timer_t* timer = static_cast<uv_timer_t*>(dbus_timeout_get_data(timeout));
 		uv_timer_stop(timer);
 	};
-	
-	static void timeoutToggled(DBusTimeout *timeout, void *data) {
-		configureTimeout(timeout);
+	
+	static void timeoutToggled(DBusTimeout *timeout, void *data) {
+		configureTimeout(timeout);
+	};
+
+
+	
+
+	static Handle<Value> finalizeConnection(DBusConnection* connection, bool priv, int type = -1, const char* address = NULL) {
+
+		
+
+		HandleScope scope;
+		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+		DBusConnectionWrap *wrap = ObjectWrap::Unwrap<DBusConnectionWrap>(object);
+		wrap->priv = priv;
+		wrap->busType = type;
+		if (address)
+			wrap->address = address;
+		wrap->dispatcher = new DispatchBaton(wrap, dispatch);
+		wrap->ownerNotifier = new DispatchBaton(wrap, notifyOwners);
+		wrap->deliverer = new DispatchBaton(wrap, deliver);
+
+		wrap->attach(connection);
+		
+
+		
+
+		//printf("Functions have been set!\n");
+
+		wrap->Ref();
+	
+		return scope.Close(object);
+	}
+
+	static void deliverMessage(const Delivery& delivery) {
+		HandleScope scope;
+		Handle<Value> argv[1] = { DBusMessageWrap::finalizeMessage(delivery.message, delivery.callbackBaton->connection->names) };
+		TryCatch tryCatch;
+		delivery.callbackBaton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
+	}
+
+	static DBusHandlerResult handleMessage(DBusConnection* connection, DBusMessage* message, void* data) {
+		ConnectionCallbackBaton* callbackBaton = static_cast<ConnectionCallbackBaton*>(data);
+		if (!callbackBaton->predicate.matches(message))
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (!callbackBaton->sender.empty() && !callbackBaton->connection->fromOwner(callbackBaton->sender, dbus_message_get_sender(message)))
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (callbackBaton->policy && dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL) {
+			callbackBaton->policy->add(message);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+		switch (dbus_message_get_type(message)) {
+		case DBUS_MESSAGE_TYPE_METHOD_CALL:
+			callbackBaton->connection->enqueue(LANE_CALL, callbackBaton, dbus_message_ref(message), NULL);
+			break;
+		case DBUS_MESSAGE_TYPE_SIGNAL:
+			callbackBaton->connection->enqueue(LANE_SIGNAL, callbackBaton, dbus_message_ref(message), NULL);
+			break;
+		default:
+			callbackBaton->connection->enqueue(LANE_REPLY, callbackBaton, dbus_message_ref(message), NULL);
+			break;
+		}
+		return DBUS_HANDLER_RESULT_HANDLED;
+	};
+
+	static void unregister(DBusConnection *connection, void *user_data) {
+		releaseBaton(user_data);
+	}
+
+	static void releaseBaton(void* data) {
+		ConnectionCallbackBaton* baton = static_cast<ConnectionCallbackBaton*>(data);
+		if (--baton->refs == 0)
+			delete baton;
+	}
+
+	//libdbus copies the function pointers out, so one table serves every path
+	static DBusObjectPathVTable objectPathVTable;
+
+	static Handle<Value> addFilter(const Arguments &args) {
+		REQ_FN_ARG(0, callback);
+		REQ_OPEN_CONNECTION(connection, args);
+		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
+		if (args.Length() > 1)
+			parseOptions(args[1], baton);
+		if (!dbus_connection_add_filter(*connection, handleMessage, baton, releaseBaton)) {
+			delete baton;
+			THROW_ERROR(Error, "Unable to add connection filter!");
+		}
+		baton->refs++;
+		connection->filters.push_back(baton);
+		return True();
+	};
+
+
+
+	static Handle<Value> registerObjectPath(const Arguments &args) {
+		REQ_STR_ARG(0, path);
+		REQ_FN_ARG(1, callback);
+
+		DBusError error;
+		REQ_OPEN_CONNECTION(connection, args);
+		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
+		if (args.Length() > 2)
+			parseOptions(args[2], baton);
+
+		dbus_error_init(&error);
+		if (!dbus_connection_try_register_object_path(*connection, path, &objectPathVTable, baton, &error)) {
+			delete baton;
+			dbus_error_free(&error);
+			THROW_ERROR(Error, "Unable to add connection filter!");
+		}		
+		baton->refs++;
+		connection->objectPaths[path] = baton;
+				
+		return True();
+	};
+
+	static Handle<Value> unregisterObjectPath(const Arguments &args) {
+		REQ_STR_ARG(0, path);
+		REQ_OPEN_CONNECTION(connection, args);
+		std::map<std::string, ConnectionCallbackBaton*>::iterator found = connection->objectPaths.find(path);
+		if (found != connection->objectPaths.end()) {
+			releaseBaton(found->second);
+			connection->objectPaths.erase(found);
+		}
+		//The registration's own reference goes through the vtable's unregister function
+		return Boolean::New(dbus_connection_unregister_object_path(*connection, path));
+	}
+
+
+	static void deliverReply(const Delivery& delivery) {
+		ConnectionCallbackBaton* callbackBaton = delivery.callbackBaton;
+		DBusPendingCall *pending = delivery.pending;
+
+		//A cancelled call has already been forgotten; only the reference is left
+		if (callbackBaton->cancelled) {
+			dbus_pending_call_unref(pending);
+			return;
+		}
+		callbackBaton->connection->pendingCalls.erase(callbackBaton->serial);
+
+		DBusMessage* reply = dbus_pending_call_steal_reply(pending);		
+		HandleScope scope;
+		TryCatch tryCatch;
+		TraceEntry* trace = callbackBaton->trace;
+		Local<Object> object = DBusMessageWrap::finalizeMessage(reply, callbackBaton->connection->names)->ToObject();
+		DBusMessageWrap* wrap = ObjectWrap::Unwrap<DBusMessageWrap>(object);
+		Local<Value> argv[] = { object };
+
+		if (trace) {
+			trace->replied = uv_hrtime();
+			trace->reply = reply ? dbus_message_ref(reply) : NULL;
+			wrap->trace = trace;
+		}
+
+		callbackBaton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+		//The entry is only complete once the callback has had a chance to decode
+		if (trace) {
+			wrap->trace = NULL;
+			callbackBaton->trace = NULL;
+			if (callbackBaton->connection->trace)
+				callbackBaton->connection->trace->push(*trace);
+			delete trace;
+		}
+
+		//The pending call lets go of the baton with it; the lane drops its own reference after this returns
+		dbus_pending_call_unref(pending);
+
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
+	}
+
+	static void pendingCallNotifyCallback(DBusPendingCall *pending, void *data) {
+		ConnectionCallbackBaton* callbackBaton = static_cast<ConnectionCallbackBaton*>(data);
+		callbackBaton->connection->enqueue(LANE_REPLY, callbackBaton, NULL, pending);
+	};
+
+
+	static TraceEntry* beginTrace(DBusMessage* message) {
+		TraceEntry* trace = new TraceEntry();
+		const char* destination = dbus_message_get_destination(message);
+		const char* interface = dbus_message_get_interface(message);
+		const char* member = dbus_message_get_member(message);
+
+		if (destination)
+			trace->destination = destination;
+		if (interface) {
+			trace->member = interface;
+			trace->member += ".";
+		}
+		if (member)
+			trace->member += member;
+		trace->request = dbus_message_ref(message);
+		trace->start = uv_hrtime();
+		return trace;
+	}
+
+	/**
+	 * Answers a call that never got onto the wire with a made-up error
+	 * reply, delivered on the reply lane like a real one. Returns false if
+	 * not even that could be built.
+	 */
+	bool failCall(Local<Function> callback, const char* name, const char* text) {
+		DBusMessage* error = dbus_message_new(DBUS_MESSAGE_TYPE_ERROR);
+		if (!error)
+			return false;
+		if (!dbus_message_set_error_name(error, name) || !dbus_message_append_args(error, DBUS_TYPE_STRING, &text, DBUS_TYPE_INVALID)) {
+			dbus_message_unref(error);
+			return false;
+		}
+		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), this);
+		enqueue(LANE_REPLY, baton, error, NULL);
+		releaseBaton(baton);
+		return true;
+	};
+
+	//Queues message with a reply callback; timeout is in milliseconds, -1 for the default
+	static bool sendWithReply(DBusConnectionWrap* connection, DBusMessageWrap* message, int timeout, Local<Function> callback) {
+		DBusPendingCall* pendingCall = NULL;
+		TraceEntry* trace = NULL;
+
+		if (connection->trace)
+			trace = beginTrace(*message);
+
+		if (!dbus_connection_send_with_reply(*connection, *message, &pendingCall, timeout)) {
+			delete trace;
+			return connection->failCall(callback, DBUS_ERROR_NO_MEMORY, "Not enough memory to send the call");
+		}
+
+		//libdbus hands back no pending call once the connection is gone
+		if (pendingCall == NULL) {
+			delete trace;
+			return connection->failCall(callback, DBUS_ERROR_DISCONNECTED, "Connection is closed");
+		}
+
+		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
+		baton->pending = pendingCall;
+		baton->serial = dbus_message_get_serial(*message);
+		if (trace) {
+			trace->sent = uv_hrtime();
+			trace->serial = baton->serial;
+			baton->trace = trace;
+		}
+		dbus_pending_call_set_notify(pendingCall, pendingCallNotifyCallback, baton, releaseBaton);
+		connection->pendingCalls[baton->serial] = baton;
+		//A call that completed before the notify was set (e.g. an instant timeout) is never notified
+		if (dbus_pending_call_get_completed(pendingCall))
+			pendingCallNotifyCallback(pendingCall, baton);
+		return true;
+	};
+
+	static Handle<Value> send(const Arguments &args) {
+		REQ_OPEN_CONNECTION(connection, args);
+		REQ_MSG_ARG(0, message);
+
+		dbus_uint32_t serial;
+		TraceEntry* trace = NULL;
+
+		//A serial means it went out already; a second send would share it, and its pending call slot
+		if (dbus_message_get_serial(*message) != 0)
+			THROW_ERROR(Error, "Message has already been sent; fill() it to send it again!");
+
+		switch(args.Length()) {
+		//message
+		case 1:
+			//Calls with a callback get a Disconnected error instead
+			if (!dbus_connection_get_is_connected(*connection))
+				THROW_ERROR(Error, "Connection is not connected!");
+			if (connection->trace)
+				trace = beginTrace(*message);
+			dbus_connection_send(*connection, *message, &serial);
+			if (trace) {
+				trace->sent = uv_hrtime();
+				trace->serial = serial;
+				connection->trace->push(*trace);
+				delete trace;
+			}
+			break;
+		//message, callback
+		case 2: {
+			REQ_FN_ARG(1, callback);
+			if (!sendWithReply(connection, message, -1, callback))
+				THROW_ERROR(Error, "Out of memory!");
+			break;
+		}
+		//message, timeout, callback
+		case 3: {
+			REQ_INT_ARG(1, timeout);
+			REQ_FN_ARG(2, callback);
+			if (!sendWithReply(connection, message, timeout, callback))
+				THROW_ERROR(Error, "Out of memory!");
+			break;
+		}
+		}
+
+		//Like a writable stream: false means wait for the drain callback
+		if (dbus_connection_get_outgoing_size(*connection) < connection->highWaterMark)
+			return True();
+		connection->needDrain = true;
+		return False();
+	};
+
+	/**
+	 * Blocking calls
+	 * callBlocking(bus, message, timeout, callback) waits for the reply with
+	 * send_with_reply_and_block on the threadpool. Workers use private
+	 * connections that are never attached to the event loop, so a blocked
+	 * worker cannot hold up dispatch on the main thread; idle ones are kept
+	 * per bus type for the next call. The reply is snapshotted on the worker
+	 * and only materialised here: callback(error, arguments).
+	 */
+	struct BlockingBaton {
+		uv_work_t work;
+		DBusBusType type;
+		DBusMessage* message;
+		int timeout;
+		Persistent<Function> callback;
+		std::string errorName;
+		std::string errorMessage;
+		std::vector<DBusSnapshot> arguments;
 	};
 
+	static uv_mutex_t blockingLock;
+	static std::vector<DBusConnection*> blockingIdle[DBUS_BUS_STARTER + 1];
 
-	
+	static DBusConnection* acquireBlocking(DBusBusType type, DBusError* error) {
+		DBusConnection* connection = NULL;
 
-	static Handle<Value> finalizeConnection(DBusConnection* connection, bool priv) {
+		uv_mutex_lock(&blockingLock);
+		if (!blockingIdle[type].empty()) {
+			connection = blockingIdle[type].back();
+			blockingIdle[type].pop_back();
+		}
+		uv_mutex_unlock(&blockingLock);
 
-		
+		if (!connection && (connection = dbus_bus_get_private(type, error)))
+			dbus_connection_set_exit_on_disconnect(connection, false);
+		return connection;
+	};
 
-		HandleScope scope;
-		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
-		DBusConnectionWrap *wrap = ObjectWrap::Unwrap<DBusConnectionWrap>(object);
-		wrap->connection = connection;
-		wrap->priv = priv;
+	static void releaseBlocking(DBusBusType type, DBusConnection* connection) {
+		if (!dbus_connection_get_is_connected(connection)) {
+			dbus_connection_close(connection);
+			dbus_connection_unref(connection);
+			return;
+		}
+		//Nothing listens here; drop whatever else arrived (NameAcquired and the like)
+		while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS);
+		uv_mutex_lock(&blockingLock);
+		blockingIdle[type].push_back(connection);
+		uv_mutex_unlock(&blockingLock);
+	};
 
-		dbus_connection_set_dispatch_status_function(connection, dispatchStatus, wrap, NULL);
-		dbus_connection_set_watch_functions(connection, addWatch, removeWatch, watchToggled, wrap, NULL);
-		dbus_connection_set_timeout_functions(connection, addTimeout, removeTimeout, timeoutToggled, wrap, NULL);
+	static void callBlockingWork(uv_work_t* work) {
+		BlockingBaton* baton = static_cast<BlockingBaton*>(work->data);
+		DBusMessage* reply = NULL;
+		DBusError error;
 
-		dispatchStatus(connection, dbus_connection_get_dispatch_status(connection), wrap);
-		
+		dbus_error_init(&error);
+		DBusConnection* connection = acquireBlocking(baton->type, &error);
+		if (connection) {
+			reply = dbus_connection_send_with_reply_and_block(connection, baton->message, baton->timeout, &error);
+			releaseBlocking(baton->type, connection);
+		}
 
-		
+		if (dbus_error_is_set(&error)) {
+			baton->errorName = error.name;
+			baton->errorMessage = error.message;
+			dbus_error_free(&error);
+		}
 
-		//printf("Functions have been set!\n");
+		if (reply) {
+			DBusMessageIter iter;
+			dbus_message_iter_init(reply, &iter);
+			dbus_snapshot_iter(&iter, baton->arguments);
+			dbus_message_unref(reply);
+		}
+	};
 
-		wrap->Ref();
-	
-		return scope.Close(object);
-	}
+	static void callBlockingDone(uv_work_t* work) {
+		BlockingBaton* baton = static_cast<BlockingBaton*>(work->data);
+		HandleScope scope;
+		TryCatch tryCatch;
+		Handle<Value> argv[2] = { Null(), Undefined() };
 
-	
+		if (!baton->errorName.empty()) {
+			Local<Object> error = Exception::Error(String::New(baton->errorMessage.c_str()))->ToObject();
+			error->Set(String::NewSymbol("name"), String::New(baton->errorName.c_str()));
+			argv[0] = error;
+		}
+		else {
+			Local<Array> arguments = Array::New(baton->arguments.size());
+			for (size_t i = 0; i < baton->arguments.size(); ++i)
+				arguments->Set(i, DBusMessageWrap::materialize(baton->arguments[i]));
+			argv[1] = arguments;
+		}
 
-	static void freeConnectionCallbackBaton(void* data) {
-		//delete (ConnectionCallbackBaton*)data;
-	}
+		baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
 
+		baton->callback.Dispose();
+		dbus_message_unref(baton->message);
+		delete baton;
 
-	static void handleMessageUserland(uv_async_t* work, int status) {
-		HandleScope scope;
-		ConnectionCallbackWorkBaton<DBusMessage*>* baton = static_cast<ConnectionCallbackWorkBaton<DBusMessage*>*>(work->data);
-		Handle<Value> argv[1] = { DBusMessageWrap::finalizeMessage(baton->data) };
-		TryCatch tryCatch;
-		baton->callbackBaton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
 		if (tryCatch.HasCaught())
 			FatalException(tryCatch);
-		
-	}
+	};
 
-	static DBusHandlerResult handleMessage(DBusConnection* connection, DBusMessage* message, void* data) {
-		ConnectionCallbackWorkBaton<DBusMessage*>* baton = new ConnectionCallbackWorkBaton<DBusMessage*>(static_cast<ConnectionCallbackBaton*>(data), message, handleMessageUserland);
-		dbus_message_ref(message);
-		uv_async_send(&baton->work);
-		return DBUS_HANDLER_RESULT_HANDLED;
+	static Handle<Value> callBlocking(const Arguments &args) {
+		REQ_INT_ARG(0, type);
+		REQ_MSG_ARG(1, message);
+		REQ_INT_ARG(2, timeout);
+		REQ_FN_ARG(3, callback);
+
+		if (type < DBUS_BUS_SESSION || type > DBUS_BUS_STARTER)
+			THROW_ERROR(RangeError, "Unknown bus type");
+
+		//The worker gets its own copy, so the wrapper can be refilled or disposed meanwhile
+		DBusMessage* copy = dbus_message_copy(*message);
+		if (!copy)
+			THROW_ERROR(Error, "Out of memory");
+
+		BlockingBaton* baton = new BlockingBaton();
+		baton->work.data = baton;
+		baton->type = DBusBusType(type);
+		baton->message = copy;
+		baton->timeout = timeout;
+		baton->callback = Persistent<Function>::New(callback);
+		uv_queue_work(uv_default_loop(), &baton->work, callBlockingWork, callBlockingDone);
+		return Undefined();
 	};
 
-	static void unregister(DBusConnection *connection, void *user_data) {
+	static void checkDrain(DBusConnectionWrap* connection) {
+		if (!connection->needDrain || !connection->connection || dbus_connection_get_outgoing_size(*connection) >= connection->highWaterMark)
+			return;
 
-	}
+		connection->needDrain = false;
+		if (connection->drainCallback.IsEmpty())
+			return;
 
-	static Handle<Value> addFilter(const Arguments &args) {
-		REQ_FN_ARG(0, callback);
-		DBusConnectionWrap* connection = THIS_CONNECTION(args);
-		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
-		if (!dbus_connection_add_filter(*connection, handleMessage, baton, freeConnectionCallbackBaton))
-				THROW_ERROR(Error, "Unable to add connection filter!");
-		return True();
+		HandleScope scope;
+		TryCatch tryCatch;
+		connection->drainCallback->Call(Context::GetCurrent()->Global(), 0, NULL);
+		if (tryCatch.HasCaught())
+			FatalException(tryCatch);
 	};
 
+	/**
+	 * becomeMonitor(rules, capacity, file, callback) turns the connection
+	 * into a bus monitor. callback is called whenever there is something
+	 * to drain, or once with an error if the bus refuses; file, if not
+	 * null, receives every message marshalled back to back. A capacity of
+	 * 0 keeps nothing, for capture-only monitors. The call does not wait
+	 * for the bus: monitoring starts when its reply comes in.
+	 */
+	static Handle<Value> becomeMonitor(const Arguments &args) {
+		REQ_OPEN_CONNECTION(connection, args);
+		REQ_OBJ_ARG(0, rules);
+		REQ_INT_ARG(1, capacity);
+		REQ_FN_ARG(3, callback);
+		DBusMessageIter iter, sub;
+		DBusPendingCall* pending = NULL;
+		dbus_uint32_t flags = 0;
+		FILE* file = NULL;
+
+		if (connection->monitor)
+			THROW_ERROR(Error, "Already a monitor");
+		if (capacity < 0)
+			THROW_ERROR(RangeError, "Capacity must not be negative");
+
+		if (args[2]->IsString()) {
+			file = fopen(*String::Utf8Value(args[2]), "ab");
+			if (!file)
+				THROW_ERROR(Error, strerror(errno));
+		}
 
+		DBusMessage* call = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, "org.freedesktop.DBus.Monitoring", "BecomeMonitor");
+		dbus_message_iter_init_append(call, &iter);
+		dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &sub);
+		for (uint32_t i = 0, length = rules->Get(String::NewSymbol("length"))->Uint32Value(); i < length; ++i) {
+			String::Utf8Value rule(rules->Get(i));
+			const char* value = *rule;
+			dbus_message_iter_append_basic(&sub, DBUS_TYPE_STRING, &value);
+		}
+		dbus_message_iter_close_container(&iter, &sub);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &flags);
+
+		if (!dbus_connection_send_with_reply(*connection, call, &pending, -1) || !pending) {
+			dbus_message_unref(call);
+			if (file)
+				fclose(file);
+			THROW_ERROR(Error, "Unable to send BecomeMonitor!");
+		}
+		dbus_message_unref(call);
+
+		connection->monitor = new Monitor(capacity, file);
+		connection->monitor->callback = Persistent<Function>::New(callback);
+		if (!connection->monitorNotifier)
+			connection->monitorNotifier = new DispatchBaton(connection, notifyMonitor);
+		//The pending call keeps the wrapper alive until the bus has answered
+		connection->Ref();
+		dbus_pending_call_set_notify(pending, monitorStarted, connection, unrefConnection);
+		if (dbus_pending_call_get_completed(pending))
+			monitorStarted(pending, connection);
+		dbus_pending_call_unref(pending);
+		return Undefined();
+	};
 
-	static Handle<Value> registerObjectPath(const Arguments &args) {
-		REQ_STR_ARG(0, path);
-		REQ_FN_ARG(1, callback);
-
-		DBusError error;
+	//Hands over up to max (default all) monitored messages, oldest first
+	static Handle<Value> drainMonitor(const Arguments &args) {
 		DBusConnectionWrap* connection = THIS_CONNECTION(args);
-		DBusObjectPathVTable *vtable = new DBusObjectPathVTable();
-		ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
-
-		vtable->message_function = handleMessage;
-		vtable->unregister_function = unregister;
-
+		Monitor* monitor = connection->monitor;
+		HandleScope scope;
 
+		if (!monitor)
+			return Undefined();
 
-		dbus_error_init(&error);
-		if (!dbus_connection_try_register_object_path(*connection, path, vtable, baton, &error)) {
-			THROW_ERROR(Error, "Unable to add connection filter!");
-		}		
-				
-		return True();
+		size_t count = monitor->count;
+		if (args.Length() > 0 && args[0]->IsUint32() && args[0]->Uint32Value() < count)
+			count = args[0]->Uint32Value();
+
+		Local<Array> result = Array::New(count);
+		for (size_t i = 0; i < count; ++i)
+			result->Set(i, DBusMessageWrap::finalizeMessage(monitor->shift(), connection->names));
+		//Messages lost to overflow since the last drain
+		result->Set(String::NewSymbol("dropped"), Number::New(monitor->dropped));
+		monitor->dropped = 0;
+		return scope.Close(result);
 	};
 
-	static Handle<Value> unregisterObjectPath(const Arguments &args) {
-
-	}
-
-
-	static void pendingCallNotifyCallbackUserland(uv_async_t* work, int status) {
-
-		ConnectionCallbackWorkBaton<DBusPendingCall*>* baton = static_cast<ConnectionCallbackWorkBaton<DBusPendingCall*>*>(work->data);
-		DBusPendingCall *pending = baton->data;
-
-		DBusMessage* reply = dbus_pending_call_steal_reply(pending);		
-		HandleScope scope;
-		TryCatch tryCatch;
-		Local<Value> argv[] = { Local<Value>::New(DBusMessageWrap::finalizeMessage(reply)) };
-		baton->callbackBaton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
-		if (tryCatch.HasCaught())
-			FatalException(tryCatch);
-		dbus_pending_call_unref(pending);
-			
-			
-		
-
-		//delete baton;
-	}
+	/**
+	 * relay(target, rules, timeout) copies messages matching any of rules
+	 * (MessagePredicate fields plus sender, and destination/path rewrites
+	 * under "to") onto target natively; returns an id for unrelay.
+	 */
+	static Handle<Value> relay(const Arguments &args) {
+		REQ_OPEN_CONNECTION(connection, args);
+		REQ_OBJ_ARG(0, targetObject);
+		REQ_OBJ_ARG(1, rulesObject);
+		int timeout = args.Length() > 2 && args[2]->IsInt32() ? args[2]->Int32Value() : -1;
+
+		if (!constructorTemplate->HasInstance(targetObject))
+			THROW_ERROR(TypeError, "Argument 0 must be a connection");
+		DBusConnectionWrap* target = ObjectWrap::Unwrap<DBusConnectionWrap>(targetObject);
+		if (!connection->connection || !target->connection)
+			THROW_ERROR(Error, "Both connections must be open!");
+		if (target == connection)
+			THROW_ERROR(Error, "A connection cannot relay to itself!");
+		if (!rulesObject->IsArray())
+			THROW_ERROR(TypeError, "Argument 1 must be an array of rules");
+
+		Local<Array> rules = Local<Array>::Cast(rulesObject);
+		Relay* relay = new Relay(++lastRelay, target, timeout);
+		for (uint32_t i = 0; i < rules->Length(); ++i) {
+			if (!rules->Get(i)->IsObject())
+				continue;
+			Local<Object> object = rules->Get(i)->ToObject();
+			Local<Value> to = object->Get(String::NewSymbol("to"));
+			RelayRule rule;
+			parsePredicate(object, rule.predicate);
+			readString(object, "sender", rule.sender);
+			if (to->IsObject()) {
+				readString(to->ToObject(), "destination", rule.destination);
+				readString(to->ToObject(), "path", rule.path);
+			}
+			if (!rule.sender.empty())
+				connection->watchOwner(rule.sender);
+			if (!(rule.match = connection->matchFor(rule)).empty())
+				connection->addMatch(rule.match);
+			relay->rules.push_back(rule);
+		}
 
-	static void pendingCallNotifyCallback(DBusPendingCall *pending, void *data) {
-		ConnectionCallbackWorkBaton<DBusPendingCall*>* baton = new ConnectionCallbackWorkBaton<DBusPendingCall*>(static_cast<ConnectionCallbackBaton*>(data), pending, pendingCallNotifyCallbackUserland);
-		uv_async_send(&baton->work);
+		target->Ref();
+		connection->relays.push_back(relay);
+		return Integer::NewFromUnsigned(relay->id);
 	};
 
+	//unrelay(id) returns how many messages the relay forwarded, or false if it was gone
+	static Handle<Value> unrelay(const Arguments &args) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		if (args.Length() < 1 || !args[0]->IsUint32())
+			THROW_ERROR(TypeError, "Argument 0 must be a relay id");
+		for (std::list<Relay*>::iterator i = connection->relays.begin(); i != connection->relays.end(); ++i) {
+			if ((*i)->id == args[0]->Uint32Value()) {
+				double forwarded = (*i)->forwarded;
+				connection->removeRelay(i);
+				return Number::New(forwarded);
+			}
+		}
+		return False();
+	};
 
-	static Handle<Value> send(const Arguments &args) {
+	//cancel(serial) drops a call sent with a callback; true if it was still outstanding
+	static Handle<Value> cancel(const Arguments &args) {
 		DBusConnectionWrap* connection = THIS_CONNECTION(args);
-		REQ_MSG_ARG(0, message);
+		if (args.Length() < 1 || !args[0]->IsUint32())
+			THROW_ERROR(TypeError, "Argument 0 must be a serial");
+		return Boolean::New(connection->cancelCall(args[0]->Uint32Value()));
+	};
 
-		dbus_uint32_t serial;
-		
-		int timeout = -1;
+	//setInboundHighWaterMark(count, callback(paused)); a count of 0 never pauses
+	static Handle<Value> setInboundHighWaterMark(const Arguments &args) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		if (args.Length() < 1 || !args[0]->IsUint32())
+			THROW_ERROR(TypeError, "Argument 0 must be a count");
+		connection->inboundHighWaterMark = args[0]->Uint32Value();
+		if (args.Length() > 1 && args[1]->IsFunction()) {
+			if (!connection->flowCallback.IsEmpty())
+				connection->flowCallback.Dispose();
+			connection->flowCallback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+		}
+		if (connection->paused && (connection->inboundHighWaterMark == 0 || connection->queued <= connection->inboundHighWaterMark / 2))
+			connection->setPaused(false);
+		else if (!connection->paused && connection->inboundHighWaterMark > 0 && connection->queued > connection->inboundHighWaterMark)
+			connection->setPaused(true);
+		return Undefined();
+	};
 
-		switch(args.Length()) {
-		//message
-		case 1:
-			dbus_connection_send(*connection, *message, &serial);
-			break;
-		//message, callback
-		//case 2:
-		//	REQ_FN_ARG(1, callback);
-		//message, timeout, callback
-		case 3:
-			REQ_INT_ARG(1, timeout);
-			REQ_FN_ARG(2, callback);
+	//setLaneBudgets(replies, calls, signals): deliveries per lane and turn, at least one each
+	static Handle<Value> setLaneBudgets(const Arguments &args) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		for (int lane = 0; lane < LANE_COUNT; ++lane) {
+			if (lane < args.Length() && args[lane]->IsUint32())
+				connection->laneBudget[lane] = args[lane]->Uint32Value() > 0 ? args[lane]->Uint32Value() : 1;
+		}
+		return Undefined();
+	};
 
-			DBusPendingCall* pendingCall = NULL;
-			
+	static Handle<Value> trackNames(const Arguments &args) {
+		REQ_FN_ARG(0, callback);
+		REQ_OPEN_CONNECTION(connection, args);
+		if (!connection->ownerCallback.IsEmpty())
+			connection->ownerCallback.Dispose();
+		connection->ownerCallback = Persistent<Function>::New(callback);
+		return Undefined();
+	};
 
-			if (!dbus_connection_send_with_reply(*connection, *message, &pendingCall, timeout)) {
-				printf("FUUUU\n");
-			}
+	static Handle<Value> watchName(const Arguments &args) {
+		REQ_STR_ARG(0, name);
+		REQ_OPEN_CONNECTION(connection, args);
+		connection->watchOwner(name);
+		return Undefined();
+	};
 
-			if (pendingCall == NULL) {
-				printf("FUUUUUU\n");
-				break;
-			}
+	//The owner's unique name, null if unowned, undefined if not known (yet)
+	static Handle<Value> nameOwner(const Arguments &args) {
+		REQ_STR_ARG(0, name);
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		if (name[0] == ':')
+			return String::New(name);
+		std::map<std::string, std::string>::iterator found = connection->owners.find(name);
+		if (found == connection->owners.end())
+			return Undefined();
+		if (found->second.empty())
+			return Null();
+		return String::New(found->second.c_str());
+	};
 
-			if (!dbus_pending_call_get_completed(pendingCall)) {
-				ConnectionCallbackBaton* baton = new ConnectionCallbackBaton(Persistent<Function>::New(callback), connection);
-				dbus_pending_call_set_notify(pendingCall, pendingCallNotifyCallback, baton, freeConnectionCallbackBaton);
-			}
-			else {
-				printf("DURR RESPONSE\n");
-			}
-			break;
-		
+	static Handle<Value> setHighWaterMark(const Arguments &args) {
+		REQ_INT_ARG(0, bytes);
+		REQ_OPEN_CONNECTION(connection, args);
+		if (bytes <= 0)
+			THROW_ERROR(RangeError, "High water mark must be positive!");
+		connection->highWaterMark = bytes;
+		if (args.Length() > 1) {
+			REQ_FN_ARG(1, callback);
+			if (!connection->drainCallback.IsEmpty())
+				connection->drainCallback.Dispose();
+			connection->drainCallback = Persistent<Function>::New(callback);
 		}
 		return Undefined();
 	};
@@ -995,6 +4344,45 @@ public:
 		return Undefined();
 	}
 
+	static Handle<Value> setTracing(const Arguments &args) {
+		REQ_INT_ARG(0, capacity);
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		if (capacity < 0)
+			THROW_ERROR(RangeError, "Trace capacity must not be negative!");
+		delete connection->trace;
+		connection->trace = capacity > 0 ? new TraceRing(capacity) : NULL;
+		return Undefined();
+	}
+
+	static Handle<Value> drainTrace(const Arguments &args) {
+		HandleScope scope;
+		TraceRing* ring = THIS_CONNECTION(args)->trace;
+		
+		if (!ring)
+			return scope.Close(Array::New(0));
+
+		Local<Array> result = Array::New(ring->count);
+		for (unsigned int i = 0; i < ring->count; ++i) {
+			TraceEntry& entry = ring->entries[(ring->head + i) % ring->capacity];
+			Local<Object> item = Object::New();
+			item->Set(String::NewSymbol("serial"), Integer::NewFromUnsigned(entry.serial));
+			item->Set(String::NewSymbol("destination"), String::New(entry.destination.c_str()));
+			item->Set(String::NewSymbol("member"), String::New(entry.member.c_str()));
+			item->Set(String::NewSymbol("requestSize"), Integer::New(dbus_message_marshalled_size(entry.request)));
+			item->Set(String::NewSymbol("replySize"), Integer::New(dbus_message_marshalled_size(entry.reply)));
+			//Times are reported in microseconds like the trace-event format expects
+			item->Set(String::NewSymbol("start"), Number::New(entry.start / 1e3));
+			item->Set(String::NewSymbol("sendTime"), Number::New((entry.sent - entry.start) / 1e3));
+			item->Set(String::NewSymbol("replyTime"), Number::New(entry.replied ? (entry.replied - entry.sent) / 1e3 : 0));
+			item->Set(String::NewSymbol("decodeTime"), Number::New(entry.decode / 1e3));
+			result->Set(i, item);
+			entry.release();
+		}
+		result->Set(String::NewSymbol("dropped"), Integer::NewFromUnsigned(ring->dropped));
+		ring->head = ring->count = ring->dropped = 0;
+		return scope.Close(result);
+	}
+
 	static Handle<Value> get(const Arguments &args) {
 		REQ_INT_ARG(0, type);
 		OPT_BOOL_ARG(1, priv, false)
@@ -1007,7 +4395,7 @@ public:
 
 		if (!dbus_error_is_set(&error)) {
 			dbus_connection_set_exit_on_disconnect(connection, false);
-			return finalizeConnection(connection, priv);
+			return finalizeConnection(connection, priv, type);
 		}
 
 		THROW_ERROR(Error, error.message);
@@ -1022,7 +4410,7 @@ public:
 		DBusConnection* connection = !priv ? dbus_connection_open(address, &error) : dbus_connection_open_private(address, &error);
 		
 		if (!dbus_error_is_set(&error)) {
-			return finalizeConnection(connection, priv);
+			return finalizeConnection(connection, priv, -1, address);
 		}
 
 		THROW_ERROR(Error, error.message);
@@ -1032,11 +4420,31 @@ public:
 	static Handle<Value> requestName(const Arguments &args) {
 		REQ_STR_ARG(0, name);
 		OPT_INT_ARG(1, opts, 0);
+		REQ_OPEN_CONNECTION(connection, args);
 		int result;
 		DBusError error;
 		
 		dbus_error_init(&error);
-		result = dbus_bus_request_name(*THIS_CONNECTION(args), name, opts, &error);
+		result = dbus_bus_request_name(*connection, name, opts, &error);
+
+		if (!dbus_error_is_set(&error)) {
+			if (result != DBUS_REQUEST_NAME_REPLY_EXISTS)
+				connection->requestedNames[name] = opts;
+			return Integer::New(result);
+		}
+
+		THROW_ERROR(Error, error.message);
+	};
+
+	static Handle<Value> releaseName(const Arguments &args) {
+		REQ_STR_ARG(0, name);
+		REQ_OPEN_CONNECTION(connection, args);
+		int result;
+		DBusError error;
+
+		dbus_error_init(&error);
+		connection->requestedNames.erase(name);
+		result = dbus_bus_release_name(*connection, name, &error);
 
 		if (!dbus_error_is_set(&error))
 			return Integer::New(result);
@@ -1044,9 +4452,55 @@ public:
 		THROW_ERROR(Error, error.message);
 	};
 
+	//addMatch(rule) and removeMatch(rule) do not wait for the bus to answer
+	static Handle<Value> addMatch(const Arguments &args) {
+		REQ_STR_ARG(0, rule);
+		REQ_OPEN_CONNECTION(connection, args);
+		connection->addMatch(rule);
+		return Undefined();
+	};
+
+	static Handle<Value> removeMatch(const Arguments &args) {
+		REQ_STR_ARG(0, rule);
+		return Boolean::New(THIS_CONNECTION(args)->removeMatch(rule));
+	};
+
+	/**
+	 * setReconnect(delay, maxDelay, callback(event, attempts, ms)) turns
+	 * reconnecting on: the first attempt is made straight away, then after
+	 * delay ms, doubling up to maxDelay; a delay below 0 turns it off.
+	 * event is "disconnect", "retry" or "reconnect".
+	 */
+	static Handle<Value> setReconnect(const Arguments &args) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(args);
+		REQ_INT_ARG(0, delay);
+		OPT_INT_ARG(1, maxDelay, 30000);
+
+		if (delay < 0) {
+			connection->stopReconnecting();
+			return Undefined();
+		}
+		if (!connection->dispatcher)
+			THROW_ERROR(Error, "Connection has been closed!");
+		connection->reconnectDelay = delay;
+		connection->reconnectMaxDelay = maxDelay < delay ? delay : maxDelay;
+		if (args.Length() > 2 && args[2]->IsFunction()) {
+			if (!connection->reconnectCallback.IsEmpty())
+				connection->reconnectCallback.Dispose();
+			connection->reconnectCallback = Persistent<Function>::New(Local<Function>::Cast(args[2]));
+		}
+		if (!connection->reconnectTimer) {
+			connection->reconnectTimer = new uv_timer_t;
+			uv_timer_init(uv_default_loop(), connection->reconnectTimer);
+			connection->reconnectTimer->data = connection;
+		}
+		return Undefined();
+	};
+
 	static Handle<Value> canSendType(const Arguments &args) {
 		REQ_INT_ARG(0, type);
-		return Boolean::New(dbus_connection_can_send_type(*THIS_CONNECTION(args), type));
+		REQ_OPEN_CONNECTION(connection, args);
+		return Boolean::New(dbus_connection_can_send_type(*connection, type));
 	};
 
 	/*
@@ -1067,23 +4521,223 @@ public:
 	};*/
 
 	static Handle<Value> serverId(Local<String> property, const AccessorInfo& info) {
-		return String::New(dbus_connection_get_server_id(*THIS_CONNECTION(info)));
+		REQ_OPEN_CONNECTION(connection, info);
+		return String::New(dbus_connection_get_server_id(*connection));
+	};
+
+	static Handle<Value> outgoingSize(Local<String> property, const AccessorInfo& info) {
+		REQ_OPEN_CONNECTION(connection, info);
+		return Number::New(dbus_connection_get_outgoing_size(*connection));
+	};
+
+	static Handle<Value> getMaxMessageSize(Local<String> property, const AccessorInfo& info) {
+		REQ_OPEN_CONNECTION(connection, info);
+		return Number::New(dbus_connection_get_max_message_size(*connection));
+	};
+
+	static void setMaxMessageSize(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(info);
+		if (!connection->connection) {
+			ThrowException(Exception::Error(String::New("Connection has been closed")));
+			return;
+		}
+		dbus_connection_set_max_message_size(*connection, value->IntegerValue());
+	};
+
+	static Handle<Value> getMaxReceivedSize(Local<String> property, const AccessorInfo& info) {
+		REQ_OPEN_CONNECTION(connection, info);
+		return Number::New(dbus_connection_get_max_received_size(*connection));
+	};
+
+	static void setMaxReceivedSize(Local<String> property,  Local<Value> value, const AccessorInfo& info) {
+		DBusConnectionWrap* connection = THIS_CONNECTION(info);
+		if (!connection->connection) {
+			ThrowException(Exception::Error(String::New("Connection has been closed")));
+			return;
+		}
+		dbus_connection_set_max_received_size(*connection, value->IntegerValue());
 	};
 
 	static Handle<Value> isConnected(Local<String> property, const AccessorInfo& info) {
-		return Boolean::New(dbus_connection_get_is_connected(*THIS_CONNECTION(info)));
+		DBusConnectionWrap* connection = THIS_CONNECTION(info);
+		return Boolean::New(connection->connection && dbus_connection_get_is_connected(*connection));
 	};
 
 	static Handle<Value> isAuthenticated(Local<String> property, const AccessorInfo& info) {
-		return Boolean::New(dbus_connection_get_is_authenticated(*THIS_CONNECTION(info)));
+		REQ_OPEN_CONNECTION(connection, info);
+		return Boolean::New(dbus_connection_get_is_authenticated(*connection));
 	};
 
 	static Handle<Value> isAnonymous(Local<String> property, const AccessorInfo& info) {
-		return Boolean::New(dbus_connection_get_is_anonymous(*THIS_CONNECTION(info)));
+		REQ_OPEN_CONNECTION(connection, info);
+		return Boolean::New(dbus_connection_get_is_anonymous(*connection));
 	};
 };
 Persistent<FunctionTemplate> DBusConnectionWrap::constructorTemplate;
+uv_mutex_t DBusConnectionWrap::blockingLock;
+std::map< DBusConnection*, std::list<DBusConnectionWrap*> > DBusConnectionWrap::attached;
+unsigned int DBusConnectionWrap::lastRelay = 0;
+std::vector<DBusConnection*> DBusConnectionWrap::blockingIdle[DBUS_BUS_STARTER + 1];
+DBusObjectPathVTable DBusConnectionWrap::objectPathVTable = { DBusConnectionWrap::unregister, DBusConnectionWrap::handleMessage };
+
+
+/**
+ * DBusMessageIteratorWrap
+ * A cursor over a message body, created with message.iterator(). Values
+ * are decoded one at a time or in chunks, and enter()/leave() step into
+ * and out of containers, so large replies can be consumed incrementally
+ * or abandoned early. The iterator keeps its own reference to the message.
+ */
+class DBusMessageIteratorWrap : ObjectWrap {
+public:
+	static Persistent<FunctionTemplate> constructorTemplate;
+
+	DBusMessage* message;
+	InternTable* names;
+	std::vector<DBusMessageIter> stack;
+
+	DBusMessageIteratorWrap() : ObjectWrap(), message(NULL), names(NULL) {
+
+	};
+
+	~DBusMessageIteratorWrap() {
+		if (message)
+			dbus_message_unref(message);
+		if (names)
+			names->unref();
+	};
+
+	static void Init(Handle<Object> target) {
+		Local<FunctionTemplate> t = FunctionTemplate::New(New);
+		constructorTemplate = Persistent<FunctionTemplate>::New(t);
+		constructorTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+		constructorTemplate->SetClassName(String::NewSymbol("DBusMessageIterator"));
+
+		NODE_SET_PROTOTYPE_METHOD(DBusMessageWrap::constructorTemplate, "iterator", create);
+
+		NODE_SET_PROTOTYPE_METHOD(t, "next", next);
+		NODE_SET_PROTOTYPE_METHOD(t, "chunk", chunk);
+		NODE_SET_PROTOTYPE_METHOD(t, "skip", skip);
+		NODE_SET_PROTOTYPE_METHOD(t, "enter", enter);
+		NODE_SET_PROTOTYPE_METHOD(t, "leave", leave);
+
+		NODE_SET_GETTER(t, "done", done);
+		NODE_SET_GETTER(t, "type", type);
+		NODE_SET_GETTER(t, "depth", depth);
+	};
+
+	static Handle<Value> New(const Arguments &args) {
+		HandleScope scope;
+		DBusMessageIteratorWrap* object = new DBusMessageIteratorWrap();
+		object->Wrap(args.This());
+		return args.This();
+	};
+
+	static Handle<Value> create(const Arguments &args) {
+		HandleScope scope;
+		DBusMessageWrap* source = THIS_MESSAGE(args);
+		DBusMessageIter iter;
+
+		if (!source->message)
+			THROW_ERROR(Error, "Message has been disposed!");
+
+		Local<Object> object = constructorTemplate->GetFunction()->NewInstance();
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(object);
+		wrap->message = dbus_message_ref(source->message);
+		wrap->names = source->names;
+		if (wrap->names)
+			wrap->names->ref();
+		dbus_message_iter_init(wrap->message, &iter);
+		wrap->stack.push_back(iter);
+		return scope.Close(object);
+	};
+
+	DBusMessageIter* top() {
+		return &stack.back();
+	};
+
+	int current() {
+		return dbus_message_iter_get_arg_type(top());
+	};
+
+	//Dict entries have no value of their own; they come out as [key, value]
+	Handle<Value> decodeCurrent() {
+		DBusMessageWrap::DecodingScope decodingScope(message);
+		if (current() != DBUS_TYPE_DICT_ENTRY)
+			return DBusMessageWrap::decode(top(), names);
+
+		DBusMessageIter entry;
+		Local<Array> pair = Array::New(2);
+		dbus_message_iter_recurse(top(), &entry);
+		pair->Set(0, DBusMessageWrap::decode(&entry, names));
+		dbus_message_iter_next(&entry);
+		pair->Set(1, DBusMessageWrap::decode(&entry, names));
+		return pair;
+	};
+
+	static Handle<Value> next(const Arguments &args) {
+		HandleScope scope;
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(args.This());
+		if (wrap->current() == DBUS_TYPE_INVALID)
+			return Undefined();
+		Handle<Value> value = wrap->decodeCurrent();
+		dbus_message_iter_next(wrap->top());
+		return scope.Close(value);
+	};
+
+	static Handle<Value> chunk(const Arguments &args) {
+		HandleScope scope;
+		OPT_INT_ARG(0, size, 256);
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(args.This());
+		Local<Array> result = Array::New();
+		int count = 0;
+
+		while (count < size && wrap->current() != DBUS_TYPE_INVALID) {
+			result->Set(count++, wrap->decodeCurrent());
+			dbus_message_iter_next(wrap->top());
+		}
+		return scope.Close(result);
+	};
 
+	static Handle<Value> skip(const Arguments &args) {
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(args.This());
+		return Boolean::New(dbus_message_iter_next(wrap->top()));
+	};
+
+	static Handle<Value> enter(const Arguments &args) {
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(args.This());
+		DBusMessageIter sub;
+
+		if (!dbus_type_is_container(wrap->current()))
+			return False();
+		dbus_message_iter_recurse(wrap->top(), &sub);
+		wrap->stack.push_back(sub);
+		return True();
+	};
+
+	//Steps back out to the enclosing level, past the container that was entered
+	static Handle<Value> leave(const Arguments &args) {
+		DBusMessageIteratorWrap* wrap = ObjectWrap::Unwrap<DBusMessageIteratorWrap>(args.This());
+		if (wrap->stack.size() < 2)
+			return False();
+		wrap->stack.pop_back();
+		dbus_message_iter_next(wrap->top());
+		return True();
+	};
+
+	static Handle<Value> done(Local<String> property, const AccessorInfo& info) {
+		return Boolean::New(ObjectWrap::Unwrap<DBusMessageIteratorWrap>(info.This())->current() == DBUS_TYPE_INVALID);
+	};
+
+	static Handle<Value> type(Local<String> property, const AccessorInfo& info) {
+		return Integer::New(ObjectWrap::Unwrap<DBusMessageIteratorWrap>(info.This())->current());
+	};
+
+	static Handle<Value> depth(Local<String> property, const AccessorInfo& info) {
+		return Integer::New(ObjectWrap::Unwrap<DBusMessageIteratorWrap>(info.This())->stack.size() - 1);
+	};
+};
+Persistent<FunctionTemplate> DBusMessageIteratorWrap::constructorTemplate;
 
 
 extern "C" {
@@ -1166,6 +4820,10 @@ extern "C" {
 
 		DBusConnectionWrap::Init(target);
 		DBusMessageWrap::Init(target);
+		DBusSchemaWrap::Init(target);
+		DBusBlobWrap::Init(target);
+		DBusVariantWrap::Init(target);
+		DBusMessageIteratorWrap::Init(target);
 	}
 
 	NODE_MODULE(dbus, init)
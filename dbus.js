@@ -6,14 +6,27 @@ var
 	EventEmitter = require('events').EventEmitter;
 
 
+/**
+ * Every open DBus is closed on exit by one shared listener instead of
+ * one listener per instance.
+ */
+var open = [ ];
+
+process.on("exit", function() {
+	open.slice().forEach(function(bus) {
+		bus.close();
+	});
+});
 
 /**
  * DBus
  * This wraps a bus object.
  */
 function DBus(bus, destination) {
+	EventEmitter.call(this);
 	switch(typeof bus) {
 	case "number":
+		this.type = bus;
 		this.backend = dbus.get(bus);
 		break;
 	case "object":
@@ -22,13 +35,36 @@ function DBus(bus, destination) {
 	}
 	
 	this.destination = destination;
+	//Bumped whenever the destination changes hands; DBusObject drops its cached introspection then
+	this.generation = 0;
 
 	var self = this;
-	process.on("exit", function() {
-		self.close();
-	})
+	open.push(this);
+	this.backend.setHighWaterMark(DBus.HIGH_WATER_MARK, function() {
+		self.emit("drain");
+	});
+	this.backend.setInboundHighWaterMark(DBus.INBOUND_HIGH_WATER_MARK, function(paused) {
+		self.emit(paused ? "pause" : "resume");
+	});
+	this.backend.trackNames(function(name, oldOwner, newOwner) {
+		if (name === self.destination)
+			++self.generation;
+		self.emit("nameOwnerChanged", name, oldOwner, newOwner);
+	});
+	if (typeof destination === "string")
+		this.backend.watchName(destination);
 }
+util.inherits(DBus, EventEmitter);
+
+
+DBus.HIGH_WATER_MARK = 1024 * 1024;
 
+/**
+ * Incoming messages waiting for JS before the connection stops reading
+ * ("pause"); it reads again ("resume") once half of them are through.
+ * Signals held back by an object's debounce/rate policy do not count.
+ */
+DBus.INBOUND_HIGH_WATER_MARK = 4096;
 
 DBus.SYSTEM = dbus.DBUS_BUS_SYSTEM;
 DBus.SESSION = dbus.DBUS_BUS_SESSION;
@@ -37,64 +73,713 @@ DBus.get = function(bus, destination) {
 	return new DBus(bus, destination);
 }
 
+/**
+ * Binds a signature to field names so structs and dicts decode into
+ * plain objects; see DBusProxy#shape.
+ */
+DBus.schema = dbus.schema;
+
+/**
+ * Encodes values against a signature once. The blob can stand in for an
+ * argument of that signature, or for all of a message's arguments, and is
+ * copied over natively on every send instead of being encoded again.
+ * The copy still walks the values, except for arrays of fixed-width types
+ * (ay, ai, ad, ...), which go over in one piece. Only a blob of a single
+ * complete type can go inside a variant.
+ */
+DBus.blob = dbus.blob;
+
+/**
+ * Tags a value with the signature it should be sent as inside a variant.
+ * Untagged values are inferred: numbers as i, u or d, arrays and objects
+ * whose members all have the same signature as typed arrays and dicts,
+ * anything else as av and a{sv}.
+ *
+ * 64-bit integers (x and t) always decode as decimal strings, whatever
+ * their size, and encode from either numbers or decimal strings; a
+ * negative value for t is rejected rather than wrapped.
+ */
+DBus.variant = dbus.variant;
+
+/**
+ * Profiling
+ * Turns the codec profiler on or off. While it is on, every message body
+ * decoded or encoded is totalled per signature; turning it on again
+ * starts from empty totals.
+ */
+DBus.profile = function(enabled) {
+	dbus.setProfiling(enabled !== false);
+}
+
+/**
+ * Returns the profiler totals as a text table, slowest signature first,
+ * or the raw rows when raw is true. Reset clears the totals afterwards.
+ */
+DBus.profileReport = function(raw, reset) {
+	var rows = dbus.profile(!!reset);
+
+	if (raw)
+		return rows;
+
+	function pad(value, width) {
+		value = String(value);
+		while (value.length < width)
+			value = " " + value;
+		return value;
+	}
+
+	return [ "direction      count    time(ms)   avg(us)       bytes      values  signature" ].concat(rows.map(function(row) {
+		return [
+			row.direction,
+			pad(row.count, 10),
+			pad((row.time / 1e6).toFixed(3), 11),
+			pad((row.time / row.count / 1e3).toFixed(1), 9),
+			pad(row.bytes, 11),
+			pad(row.values, 11),
+			" " + (row.signature || "(empty)")
+		].join(" ");
+	})).join("\n");
+}
+
+var defer = global.setImmediate || function(fn) { setTimeout(fn, 0) };
+
+/**
+ * Walks the elements of argument index of a message in chunks of size,
+ * giving the event loop a turn between chunks. Dict entries arrive as
+ * [key, value] pairs. Returning false from onChunk stops early.
+ */
+DBus.stream = function(message, index, size, onChunk, onEnd) {
+	var iterator = message.iterator();
+
+	for (var i = 0; i < index; ++i)
+		iterator.skip();
+	if (!iterator.enter())
+		throw new TypeError("Argument "+index+" is not a container!");
+
+	(function step() {
+		var chunk = iterator.chunk(size);
+		if (chunk.length === 0 || onChunk(chunk) === false || iterator.done)
+			return onEnd && onEnd();
+		defer(step);
+	})();
+}
+
 DBus.system = DBus.get.bind(undefined, DBus.SYSTEM);
 DBus.session = DBus.get.bind(undefined, DBus.SESSION);
 
 
 DBus.prototype.close = function() {
+	var index = open.indexOf(this);
+	if (index !== -1)
+		open.splice(index, 1);
 	this.backend.close();
 }
 
-DBus.prototype.object = function(path) {
-	return new DBusObject(this, path);
+/**
+ * Queues a message. Returns false once more than the high water mark is
+ * waiting to be written; hold further sends until "drain" is emitted.
+ */
+DBus.prototype.send = function(message, timeout, callback) {
+	return this.backend.send.apply(this.backend, arguments);
+}
+
+/**
+ * Calls
+ * Like send() with a callback, but returns a handle whose cancel() drops
+ * the call: the callback is never called and its native state is freed
+ * at once. options: { timeout: ms, deadline: a Date.now() time by which
+ * the reply must be in, signal: an AbortSignal-like object (aborted flag
+ * and an "abort" event) that cancels the call }. A call that cannot be
+ * sent is answered with an error reply, so the callback always runs
+ * unless the call is cancelled. A message goes out once; fill() it to
+ * send it again.
+ */
+DBus.prototype.call = function(message, options, callback) {
+	if (typeof options === "function") {
+		callback = options;
+		options = { };
+	}
+	options = options || { };
+
+	var backend = this.backend, signal = options.signal, serial,
+		timeout = typeof options.timeout === "number" ? options.timeout : -1,
+		handle = { serial: undefined, cancelled: false, cancel: cancel };
+
+	//Past the deadline libdbus answers with a NoReply error of its own
+	if (typeof options.deadline === "number") {
+		var remaining = Math.max(1, options.deadline - Date.now());
+		timeout = timeout < 0 ? remaining : Math.min(timeout, remaining);
+	}
+
+	function listen(add) {
+		if (!signal)
+			return;
+		if (typeof signal.addEventListener === "function")
+			signal[add ? "addEventListener" : "removeEventListener"]("abort", cancel);
+		else if (typeof signal.on === "function")
+			signal[add ? "on" : "removeListener"]("abort", cancel);
+	}
+
+	function cancel() {
+		if (handle.cancelled)
+			return false;
+		handle.cancelled = true;
+		listen(false);
+		return typeof serial === "number" && backend.cancel(serial);
+	}
+
+	if (signal && signal.aborted) {
+		handle.cancelled = true;
+		return handle;
+	}
+
+	backend.send(message, timeout, function(reply) {
+		//Only reachable after cancel() for calls that never got a serial
+		if (handle.cancelled)
+			return reply.dispose();
+		//Nothing left to cancel
+		serial = undefined;
+		listen(false);
+		callback(reply);
+	});
+	//A call that could not go out has no serial; its error reply is already on the way
+	handle.serial = serial = message.serial || undefined;
+	listen(true);
+	return handle;
+}
+
+/**
+ * Waits for the reply on a worker thread over a private connection of its
+ * own and calls back with (error, arguments) once it is in; meant for
+ * firing many independent probes at startup. Timeout is optional.
+ */
+DBus.callBlocking = function(bus, message, timeout, callback) {
+	if (typeof timeout === "function")
+		return dbus.callBlocking(bus, message, -1, timeout);
+	return dbus.callBlocking(bus, message, timeout, callback);
+}
+
+DBus.prototype.callBlocking = function(message, timeout, callback) {
+	if (typeof this.type !== "number")
+		throw new Error("Blocking calls need a bus type, not a raw connection!");
+	return DBus.callBlocking(this.type, message, timeout, callback);
+}
+
+DBus.prototype.setHighWaterMark = function(bytes) {
+	this.backend.setHighWaterMark(bytes);
+	return this;
+}
+
+/**
+ * Sets the inbound high water mark; 0 never pauses.
+ */
+DBus.prototype.setInboundHighWaterMark = function(count) {
+	this.backend.setInboundHighWaterMark(count);
+	return this;
+}
+
+/**
+ * Incoming messages reach JS by priority: replies to our calls, then
+ * calls to exported objects, then signals, each with a budget per turn
+ * of the event loop (256, 128 and 64 by default); leave one undefined to
+ * keep its current budget.
+ */
+DBus.prototype.setLaneBudgets = function(replies, calls, signals) {
+	this.backend.setLaneBudgets(replies, calls, signals);
+	return this;
+}
+
+/**
+ * Name owners
+ * Watched names are kept current natively from NameOwnerChanged, so
+ * nameOwner answers without a round trip: the unique name of the owner,
+ * null when unowned, undefined until the first lookup has come back.
+ * Only watched names (and the destination) are subscribed to, one match
+ * each, and only they emit "nameOwnerChanged".
+ */
+DBus.prototype.watchName = function(name) {
+	this.backend.watchName(name);
+	return this;
+}
+
+DBus.prototype.nameOwner = function(name) {
+	return this.backend.nameOwner(name);
+}
+
+/**
+ * The optional policy is applied natively to the object's signals before
+ * they reach JS: { debounce: ms, rate: signals per second, merge: bool }.
+ * Signals are coalesced per interface and member, keeping the latest or,
+ * with merge, folding PropertiesChanged change sets together. With
+ * { sender: name } only messages from the name's current owner get through.
+ */
+DBus.prototype.object = function(path, policy) {
+	return new DBusObject(this, path, policy);
+}
+
+/**
+ * Filters
+ * Sees every message on the connection that matches options, which are
+ * checked natively before anything is handed to JS: { type, sender, path
+ * (a prefix), interface, member, signature, arg0 }, plus the signal
+ * policy fields accepted by object(). The message is disposed once the
+ * callback returns.
+ */
+DBus.prototype.filter = function(options, callback) {
+	this.backend.addFilter(function(message) {
+		callback(message);
+		message.dispose();
+	}, options || { });
+	return this;
+}
+
+/**
+ * Names and matches are remembered by the connection so they can be
+ * replayed after a reconnect.
+ */
+DBus.prototype.requestName = function(name, flags) {
+	return this.backend.requestName(name, flags || 0);
+}
+
+DBus.prototype.releaseName = function(name) {
+	return this.backend.releaseName(name);
+}
+
+DBus.prototype.addMatch = function(rule) {
+	this.backend.addMatch(rule);
+	return this;
+}
+
+DBus.prototype.removeMatch = function(rule) {
+	return this.backend.removeMatch(rule);
+}
+
+/**
+ * Reconnecting
+ * Reopens the connection natively when it drops, then replays filters,
+ * object paths, match rules and requested names in one batch, so
+ * proxies, objects and listeners carry on as they were. Retries start
+ * straight away, then back off from options.delay (default 100ms) up to
+ * options.maxDelay (default 30s). Emits "disconnect", "reconnecting"
+ * (attempt, ms) after each failed attempt and "reconnect" (attempts, ms)
+ * once the connection is back. Pass false to turn it off.
+ */
+DBus.prototype.reconnect = function(options) {
+	var self = this;
+	if (options === false) {
+		this.backend.setReconnect(-1);
+		return this;
+	}
+	options = options || { };
+	this.backend.setReconnect(
+		typeof options.delay === "number" ? options.delay : 100, 
+		typeof options.maxDelay === "number" ? options.maxDelay : 30000, 
+		function(event, attempts, elapsed) {
+			switch (event) {
+			case "disconnect":
+				self.emit("disconnect");
+				break;
+			case "retry":
+				self.emit("reconnecting", attempts, elapsed);
+				break;
+			case "reconnect":
+				self.emit("reconnect", attempts, elapsed);
+				break;
+			}
+		}
+	);
+	return this;
+}
+
+/**
+ * Relaying
+ * Copies every message matching one of rules onto target without
+ * decoding it: rules take the filter fields plus sender, and rewrite
+ * headers with { to: { destination, path } }. Replies to relayed calls
+ * come back on their own; options.timeout bounds how long they may take.
+ * Relayed messages never reach objects or filters on this connection.
+ * Returns an id for unrelay.
+ */
+DBus.prototype.relay = function(target, rules, options) {
+	options = options || { };
+	return this.backend.relay(target.backend, rules, typeof options.timeout === "number" ? options.timeout : -1);
+}
+
+/**
+ * Stops a relay; returns how many messages it forwarded, or false if
+ * there was no such relay.
+ */
+DBus.prototype.unrelay = function(id) {
+	return this.backend.unrelay(id);
+}
+
+DBus.relay = function(source, target, rules, options) {
+	return source.relay(target, rules, options);
+}
+
+/**
+ * Monitoring
+ * Turns the connection into a bus monitor for the given match rules (all
+ * traffic when empty). Monitored messages skip objects and filters, wait
+ * in a native ring of options.capacity (default 4096) and are emitted as
+ * one "monitor" batch per turn of the event loop; batch.dropped counts
+ * what overflowed. Nothing is decoded unless a listener reads it, and
+ * the messages are disposed once the listeners return. options.file
+ * additionally appends every message, marshalled, to a capture file.
+ * Monitoring starts once the bus has answered; if it refuses, "error" is
+ * emitted instead and monitor() may be tried again.
+ */
+DBus.prototype.monitor = function(rules, options) {
+	var self = this;
+	options = options || { };
+	this.backend.becomeMonitor(rules || [ ], typeof options.capacity === "number" ? options.capacity : 4096, options.file || null, function(error) {
+		if (error)
+			return self.emit("error", error);
+		var batch = self.backend.drainMonitor();
+		self.emit("monitor", batch);
+		batch.forEach(function(message) {
+			message.dispose();
+		});
+	});
+	return this;
+}
+
+/**
+ * Tracing
+ * Records every outgoing call into a native ring buffer of the given
+ * capacity (default 1024); pass 0 to switch tracing off again.
+ */
+DBus.prototype.trace = function(capacity) {
+	this.backend.setTracing(typeof capacity === "number" ? capacity : 1024);
+	return this;
+}
+
+DBus.prototype.drainTrace = function() {
+	return this.backend.drainTrace();
+}
+
+/**
+ * Drains the trace ring as a Chrome trace-event document; every
+ * destination gets its own lane so slow services stand out.
+ */
+DBus.prototype.exportTrace = function() {
+	var lanes = { }, events = [ ], pid = process.pid;
+
+	this.drainTrace().forEach(function(entry) {
+		var destination = entry.destination || "(broadcast)", tid = lanes[destination];
+
+		if (typeof tid === "undefined") {
+			tid = lanes[destination] = Object.keys(lanes).length + 1;
+			events.push({ name: "thread_name", ph: "M", pid: pid, tid: tid, args: { name: destination } });
+		}
+
+		events.push({
+			name: entry.member,
+			cat: "dbus",
+			ph: "X",
+			pid: pid,
+			tid: tid,
+			ts: entry.start,
+			dur: entry.sendTime + entry.replyTime + entry.decodeTime,
+			args: {
+				serial: entry.serial,
+				requestSize: entry.requestSize,
+				replySize: entry.replySize,
+				sendTime: entry.sendTime,
+				replyTime: entry.replyTime
+			}
+		});
+
+		if (entry.decodeTime > 0)
+			events.push({
+				name: "decode",
+				cat: "dbus",
+				ph: "X",
+				pid: pid,
+				tid: tid,
+				ts: entry.start + entry.sendTime + entry.replyTime,
+				dur: entry.decodeTime
+			});
+	});
+
+	return JSON.stringify({ traceEvents: events, displayTimeUnit: "ms" });
+}
+
+/**
+ * Signal event names are "interface.member" lowercased; interface and
+ * member come back interned from the native side, so cache the result.
+ * Like the native intern table the cache stops growing at 4096 names, and
+ * it has no prototype so names such as "constructor" are looked up safely.
+ */
+var eventNames = Object.create(null), eventNameCount = 0, EVENT_NAME_LIMIT = 4096;
+
+function eventName(interfaceName, member) {
+	var members = eventNames[interfaceName], name;
+	if (members && (name = members[member]))
+		return name;
+	name = (interfaceName+"."+member).toLowerCase();
+	if (eventNameCount < EVENT_NAME_LIMIT) {
+		if (!members)
+			members = eventNames[interfaceName] = Object.create(null);
+		members[member] = name;
+		eventNameCount++;
+	}
+	return name;
+}
+
+/**
+ * DBusPool
+ * Spreads outgoing calls over several private connections to the same bus.
+ * Calls are routed by destination (so each service keeps its ordering) or,
+ * with strategy "round-robin", to the next connection in turn. Objects and
+ * their signal subscriptions live on the first connection only, once per
+ * path, so signals are never delivered twice. Like a single connection,
+ * send() returns false when its connection is over the high water mark;
+ * "drain" comes once every connection that said so has drained.
+ */
+function DBusPool(bus, size, destination, options) {
+	EventEmitter.call(this);
+	options = options || { };
+	size = size || 4;
+
+	this.type = bus;
+	this.destination = destination;
+	this.strategy = options.strategy || "destination";
+	this.members = [ ];
+	this.routes = Object.create(null);
+	this.routeCount = 0;
+	this.objects = Object.create(null);
+	this.objectCount = 0;
+	this.next = 0;
+	//Members whose last send() returned false
+	this.backlogged = [ ];
+
+	for (var i = 0; i < size; ++i)
+		this.members.push(new DBus(dbus.get(bus, true), destination));
+
+	//Registrations, signals and name owners all go through the first connection
+	this.backend = this.members[0].backend;
+
+	var self = this;
+	this.members.forEach(function(member, i) {
+		self.backlogged.push(false);
+		member.on("drain", function() {
+			if (!self.backlogged[i])
+				return;
+			self.backlogged[i] = false;
+			if (self.backlogged.indexOf(true) < 0)
+				self.emit("drain");
+		});
+		member.on("pause", function() {
+			self.emit("pause", member);
+		});
+		member.on("resume", function() {
+			self.emit("resume", member);
+		});
+		member.on("disconnect", function() {
+			self.emit("disconnect", member);
+		});
+		member.on("reconnecting", function(attempts, elapsed) {
+			self.emit("reconnecting", attempts, elapsed, member);
+		});
+		member.on("reconnect", function(attempts, elapsed) {
+			self.emit("reconnect", attempts, elapsed, member);
+		});
+	});
+	this.members[0].on("nameOwnerChanged", function(name, oldOwner, newOwner) {
+		self.emit("nameOwnerChanged", name, oldOwner, newOwner);
+	});
+}
+util.inherits(DBusPool, EventEmitter);
+
+/**
+ * Destinations whose route is remembered; past this many the route of
+ * any other destination is hashed again on every call.
+ */
+DBusPool.ROUTE_LIMIT = 1024;
+
+/**
+ * Object handles the pool hands out again for the same path; past this
+ * many, other paths get a fresh handle on every call like DBus#object.
+ */
+DBusPool.OBJECT_LIMIT = 1024;
+
+DBus.Pool = DBusPool;
+
+DBus.pool = function(bus, size, destination, options) {
+	return new DBusPool(bus, size, destination, options);
+}
+
+Object.defineProperty(DBusPool.prototype, "generation", {
+	get: function() {
+		return this.members[0].generation;
+	}
+});
+
+DBusPool.prototype.watchName = function(name) {
+	this.members[0].watchName(name);
+	return this;
+}
+
+DBusPool.prototype.nameOwner = function(name) {
+	return this.members[0].nameOwner(name);
+}
+
+DBusPool.prototype.member = function(destination) {
+	if (this.strategy === "round-robin" || typeof destination !== "string") {
+		this.next = (this.next + 1) % this.members.length;
+		return this.members[this.next];
+	}
+
+	var route = this.routes[destination];
+	if (typeof route === "undefined") {
+		route = 0;
+		for (var i = 0; i < destination.length; ++i)
+			route = (route * 31 + destination.charCodeAt(i)) >>> 0;
+		route %= this.members.length;
+		if (this.routeCount < DBusPool.ROUTE_LIMIT) {
+			this.routes[destination] = route;
+			this.routeCount++;
+		}
+	}
+	return this.members[route];
+}
+
+DBusPool.prototype.send = function(message, timeout, callback) {
+	var member = this.member(message.destination), ok = member.send.apply(member, arguments);
+	if (!ok)
+		this.backlogged[this.members.indexOf(member)] = true;
+	return ok;
+}
+
+DBusPool.prototype.callBlocking = DBus.prototype.callBlocking;
+
+DBusPool.prototype.call = function(message, options, callback) {
+	var member = this.member(message.destination);
+	return member.call.apply(member, arguments);
+}
+
+DBusPool.prototype.setLaneBudgets = function(replies, calls, signals) {
+	this.members.forEach(function(member) {
+		member.setLaneBudgets(replies, calls, signals);
+	});
+	return this;
+}
+
+/**
+ * Every member reconnects on its own; the pool re-emits each event with
+ * the member as the last argument.
+ */
+DBusPool.prototype.reconnect = function(options) {
+	this.members.forEach(function(member) {
+		member.reconnect(options);
+	});
+	return this;
+}
+
+DBusPool.prototype.setHighWaterMark = function(bytes) {
+	this.members.forEach(function(member) {
+		member.setHighWaterMark(bytes);
+	});
+	return this;
+}
+
+/**
+ * A path is registered once on the first connection, so a cached handle
+ * cannot take on a different policy; asking for one throws.
+ */
+DBusPool.prototype.object = function(path, policy) {
+	var object = this.objects[path];
+	if (object) {
+		if (typeof policy !== "undefined" && JSON.stringify(policy) !== JSON.stringify(object.policy))
+			throw new Error("Object "+path+" already has a different policy");
+		return object;
+	}
+	object = new DBusObject(this, path, policy);
+	if (this.objectCount < DBusPool.OBJECT_LIMIT) {
+		this.objects[path] = object;
+		this.objectCount++;
+	}
+	return object;
+}
+
+DBusPool.prototype.close = function() {
+	this.members.forEach(function(member) {
+		member.close();
+	});
 }
 
 /**
  * DBusObject
- * Wraps a DBus object.
- *
+ * Wraps a DBus object. Objects are only handles until something listens
+ * to them: the object path is registered natively on the first
+ * subscription, so the many objects a call can return cost nothing until
+ * they are used.
  */
-function DBusObject(bus, path) {
+function DBusObject(bus, path, policy) {
 	EventEmitter.call(this);
 	this.bus = bus;
 	this.path = path;
+	this.policy = policy;
+	this.registered = false;
 	this.introspection = undefined;
-	var self = this;
+	this.generation = bus.generation;
+}
+util.inherits(DBusObject, EventEmitter);
+
+DBusObject.prototype.attach = function() {
+	if (this.registered)
+		return this;
+	this.registered = true;
 
 	//Call the C++ code to register the object path and appropriate callback
-	bus.backend.registerObjectPath(path, (function(message) {
-		//Look at the type of message
-		switch(message.type) {
-		case dbus.DBUS_MESSAGE_TYPE_SIGNAL: //If it's a signal
-			//Emit it
-			var args = [(message.interface+"."+message.member).toLowerCase()];
-			Array.prototype.push.apply(args, message.arguments);
-			this.emit.apply(this, args);
-			
-			break;
-		case dbus.DBUS_MESSAGE_TYPE_ERROR:
+	this.bus.backend.registerObjectPath(this.path, this.receive.bind(this), this.policy);
+	return this;
+}
 
-			this.emit("error");
-		default:
-			break;
-		}
-		delete message;
+DBusObject.prototype.receive = function(message) {
+	//Look at the type of message
+	switch(message.type) {
+	case dbus.DBUS_MESSAGE_TYPE_SIGNAL: //If it's a signal
+		//Emit it
+		var args = [eventName(message.interface, message.member)];
+		Array.prototype.push.apply(args, message.arguments);
+		this.emit.apply(this, args);
 		
-	}).bind(this))
+		break;
+	case dbus.DBUS_MESSAGE_TYPE_ERROR:
 
+		this.emit("error");
+	default:
+		break;
+	}
+	//Release the native message now instead of waiting for the GC
+	message.dispose();
+}
+
+DBusObject.prototype.on = DBusObject.prototype.addListener = function(event, listener) {
+	this.attach();
+	return EventEmitter.prototype.on.call(this, event, listener);
 }
-util.inherits(DBusObject, EventEmitter);
 
 DBusObject.prototype.introspect = function(callback) {
 
+	//A new owner of the destination may export something else entirely
+	if (this.generation !== this.bus.generation) {
+		this.generation = this.bus.generation;
+		this.introspection = undefined;
+	}
+
 	if (this.introspection)
-		return this.introspection;
+		return callback(this.introspection);
 
-	var self = this, message = dbus.methodCall(this.bus.destination, this.path, "org.freedesktop.DBus.Introspectable", "Introspect");
+	var self = this, generation = this.generation, message = dbus.methodCall(this.bus.destination, this.path, "org.freedesktop.DBus.Introspectable", "Introspect");
 	
-	this.bus.backend.send(message, -1, function(response) {
+	this.bus.send(message, -1, function(response) {
+		var xml = response.arguments[0];
+		response.dispose();
 
-		DOM.parse(response.arguments[0], function(doc) {
+		DOM.parse(xml, function(doc) {
 
 			var res = { interfaces: { } };
 
@@ -141,7 +826,8 @@ DBusObject.prototype.introspect = function(callback) {
 
 			})
 			
-			self.introspection = res;
+			if (generation === self.generation)
+				self.introspection = res;
 			callback(res);
 		});
 	})
@@ -162,6 +848,7 @@ function DBusProxy(object, interfaceName) {
 	this.bus = object.bus;
 	this.interfaceName = interfaceName;
 	this.object = object;
+	this.shapes = { };
 
 	object.introspect(function(data) {
 		var dbusInterface = data.interfaces[interfaceName];
@@ -174,20 +861,30 @@ function DBusProxy(object, interfaceName) {
 			name = name.charAt(0).toLowerCase() + name.slice(1);
 
 			
+			//One message per method is refilled for every call; only the arguments are encoded again
+			var message = dbus.methodCall(self.bus.destination, object.path, dbusInterface.name, method.name);
+			message.signature = method.inputs.map(function(i) { return i.type }).join("");
+
 			self[name] = function() {
-				var message = dbus.methodCall(self.bus.destination, object.path, dbusInterface.name, method.name), callback = arguments[arguments.length - 1];
+				var callback = arguments[arguments.length - 1];
 
 				if (typeof callback !== "function")
 					throw new TypeError("Callback must be a function!");
 
-				message.signature = method.inputs.map(function(i) { return i.type }).join("");
-				message.arguments = Array.prototype.slice.call(arguments, 0, -1);
+				message.fill(Array.prototype.slice.call(arguments, 0, -1));
+
+				//Shapes are compiled on first use, once the output signature is known
+				var shape = self.shapes[method.name], schema = shape && (shape.schema || (shape.schema = dbus.schema(
+					method.outputs.map(function(o) { return o.type }).join(""), shape.descriptor
+				)));
 
 				
-				self.bus.backend.send(message, -1, (function(callback, reply) {
+				return self.bus.send(message, -1, (function(callback, reply) {
 
 					switch(reply.type) {
 					case dbus.DBUS_MESSAGE_TYPE_METHOD_RETURN:
+						if (schema)
+							reply.schema = schema;
 						var results = !reply.arguments ? [] : Array.prototype.slice.call(reply.arguments).map(function(arg, i) {
 							var signature = method.outputs[i];
 							if (signature.type === "o") {
@@ -208,6 +905,7 @@ function DBusProxy(object, interfaceName) {
 						console.log("INVALID");
 						break;
 					}
+					reply.dispose();
 
 					
 				}).bind(undefined, callback))
@@ -218,8 +916,18 @@ function DBusProxy(object, interfaceName) {
 }
 util.inherits(DBusProxy, EventEmitter)
 
+/**
+ * Decode the replies of a method into shaped objects. The descriptor
+ * lists, per output argument, the struct field names or dict keys (see
+ * dbus.schema); without one, dicts still decode into plain objects.
+ */
+DBusProxy.prototype.shape = function(method, descriptor) {
+	this.shapes[method] = { descriptor: descriptor };
+	return this;
+}
+
 DBusProxy.prototype.on = function(method, listener) {
-	var self = this, event = (this.interfaceName+"."+method).toLowerCase();
+	var self = this, event = eventName(this.interfaceName, method);
 
 	this.object.on(event, function() {
 		var args = [method];
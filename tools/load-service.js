@@ -0,0 +1,296 @@
+
+/**
+ * Load service
+ * A fake D-Bus service for capacity testing against a local dbus-daemon.
+ * It exports a number of objects, emits signals at a given rate and
+ * payload shape, and answers method calls after a given latency with
+ * replies of a given shape and size. Optional subscriber and caller
+ * connections put the other end under load too, and a report of rates
+ * (and, with --profile, codec totals per signature) is printed every
+ * --report seconds.
+ *
+ *   node tools/load-service.js --bus=session --objects=1000 \
+ *     --signal-rate=5000 --signal=a{sv} --size=16 \
+ *     --latency=2 --reply=aay --reply-size=64 \
+ *     --subscribers=8 --callers=2 --call-rate=1000 --profile
+ *
+ * --bus is "session", "system" or a D-Bus address. Payload signatures
+ * are filled with generated values; --size and --reply-size set how many
+ * elements every array and dict gets. Payloads are encoded once into a
+ * blob unless --encode asks for them to be encoded on every send.
+ */
+
+var
+	DBus = require('../dbus'),
+	dbus = require('../build/Release/dbus');
+
+var defaults = {
+	"bus": "session",
+	"name": "com.example.Load",
+	"path": "/com/example/Load",
+	"interface": "com.example.Load",
+	"objects": 100,
+	"signal": "a{sv}",
+	"signal-rate": 100,
+	"size": 8,
+	"reply": "as",
+	"reply-size": 8,
+	"latency": 0,
+	"subscribers": 0,
+	"callers": 0,
+	"call-rate": 0,
+	"report": 1,
+	"duration": 0
+};
+
+function parseArguments(argv) {
+	var options = { };
+	Object.keys(defaults).forEach(function(key) {
+		options[key] = defaults[key];
+	});
+	argv.forEach(function(arg) {
+		var match = /^--([^=]+)(?:=(.*))?$/.exec(arg);
+		if (!match)
+			throw new Error("Unknown argument "+arg);
+		var value = typeof match[2] === "undefined" ? true : match[2];
+		options[match[1]] = typeof defaults[match[1]] === "number" ? Number(value) : value;
+	});
+	return options;
+}
+
+/**
+ * Splits a signature into its complete types.
+ */
+function completeTypes(signature) {
+	var types = [ ], i = 0;
+
+	function skip() {
+		var c = signature[i++];
+		if (c === "a")
+			return skip();
+		if (c === "(" || c === "{") {
+			var close = c === "(" ? ")" : "}";
+			while (signature[i] !== close)
+				skip();
+			i++;
+		}
+	}
+
+	while (i < signature.length) {
+		var start = i;
+		skip();
+		types.push(signature.slice(start, i));
+	}
+	return types;
+}
+
+/**
+ * Builds a value of the given complete type; containers get size elements.
+ */
+function sample(type, size, seed) {
+	switch (type[0]) {
+	case "y": return seed & 0xff;
+	case "b": return seed % 2 === 0;
+	case "n": case "q": return seed & 0x7fff;
+	case "i": case "u": return seed;
+	case "x": case "t": return seed * 1000;
+	case "d": return seed / 7;
+	case "s": return "value-"+seed;
+	case "o": return "/com/example/Load/item"+seed;
+	case "g": return "a{sv}";
+	case "v": return DBus.variant("s", "variant-"+seed);
+	case "(":
+		return completeTypes(type.slice(1, -1)).map(function(member, i) {
+			return sample(member, size, seed + i);
+		});
+	case "a":
+		if (type[1] === "{") {
+			var entry = completeTypes(type.slice(2, -1)), dict = { };
+			for (var i = 0; i < size; ++i)
+				dict[sample(entry[0], size, seed + i)] = sample(entry[1], size, seed + i);
+			return dict;
+		}
+		var array = [ ];
+		for (var i = 0; i < size; ++i)
+			array.push(sample(type.slice(1), size, seed + i));
+		return array;
+	}
+	throw new Error("Cannot generate values for "+type);
+}
+
+function payload(signature, size) {
+	return completeTypes(signature).map(function(type, i) {
+		return sample(type, size, i + 1);
+	});
+}
+
+function connect(bus) {
+	switch (bus) {
+	case "session": return new DBus(dbus.get(DBus.SESSION, true));
+	case "system": return new DBus(dbus.get(DBus.SYSTEM, true));
+	default: return new DBus(dbus.open(bus, true));
+	}
+}
+
+function introspection(options) {
+	var args = function(signature, direction) {
+		return completeTypes(signature).map(function(type, i) {
+			return "<arg name=\"arg"+i+"\" type=\""+type+"\""+(direction ? " direction=\""+direction+"\"" : "")+"/>";
+		}).join("");
+	};
+	return "<node><interface name=\""+options["interface"]+"\">"+
+		"<method name=\"Fetch\">"+args(options.reply, "out")+"</method>"+
+		"<method name=\"Ping\"/>"+
+		"<signal name=\"Changed\">"+args(options.signal)+"</signal>"+
+		"</interface></node>";
+}
+
+var options = parseArguments(process.argv.slice(2)),
+	service = connect(options.bus),
+	signalValues = payload(options.signal, options.size),
+	replyValues = payload(options.reply, options["reply-size"]),
+	signalBlob = options.encode ? null : DBus.blob(options.signal, signalValues),
+	replyBlob = options.encode ? null : DBus.blob(options.reply, replyValues),
+	xml = introspection(options),
+	stats = { signals: 0, stalled: 0, calls: 0, received: 0, replies: 0, errors: 0, latency: 0 },
+	signals = [ ],
+	subscribers = [ ],
+	callers = [ ];
+
+if (options.profile)
+	DBus.profile(true);
+
+if (service.requestName(options.name, dbus.DBUS_NAME_FLAG_DO_NOT_QUEUE) !== dbus.DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+	throw new Error("Unable to own "+options.name);
+
+function answer(message) {
+	var reply;
+
+	if (message.type !== dbus.DBUS_MESSAGE_TYPE_METHOD_CALL) {
+		message.dispose();
+		return;
+	}
+
+	switch (message.interface+"."+message.member) {
+	case options["interface"]+".Fetch":
+		reply = dbus.methodReturn(message);
+		reply.signature = options.reply;
+		reply.arguments = replyBlob || replyValues;
+		break;
+	case options["interface"]+".Ping":
+		reply = dbus.methodReturn(message);
+		break;
+	case "org.freedesktop.DBus.Introspectable.Introspect":
+		reply = dbus.methodReturn(message);
+		reply.signature = "s";
+		reply.arguments = [ xml ];
+		break;
+	default:
+		reply = dbus.error(message, "org.freedesktop.DBus.Error.UnknownMethod", "No such method");
+		break;
+	}
+	message.dispose();
+	stats.calls++;
+
+	if (options.latency > 0)
+		setTimeout(function() {
+			service.send(reply);
+		}, options.latency);
+	else
+		service.send(reply);
+}
+
+for (var i = 0; i < options.objects; ++i) {
+	var path = options.path+"/item"+i, signal = dbus.signal(path, options["interface"], "Changed");
+	signal.signature = options.signal;
+	service.backend.registerObjectPath(path, answer);
+	signals.push(signal);
+}
+
+/**
+ * Signals go out from a 10ms tick, spread round robin over the objects.
+ * While the outgoing queue is over its high water mark the tick's
+ * signals are counted as stalled instead of sent.
+ */
+var due = 0, nextObject = 0, backlogged = false;
+
+service.on("drain", function() {
+	backlogged = false;
+});
+
+if (options["signal-rate"] > 0 && signals.length > 0) {
+	setInterval(function() {
+		for (due += options["signal-rate"] / 100; due >= 1; --due) {
+			if (backlogged) {
+				stats.stalled++;
+				continue;
+			}
+			var signal = signals[nextObject++ % signals.length];
+			signal.fill(signalBlob || signalValues);
+			backlogged = !service.send(signal);
+			stats.signals++;
+		}
+	}, 10);
+}
+
+for (var i = 0; i < options.subscribers; ++i) {
+	var subscriber = connect(options.bus);
+	subscriber.addMatch("type='signal',sender='"+options.name+"',interface='"+options["interface"]+"',member='Changed'");
+	subscriber.filter({ type: dbus.DBUS_MESSAGE_TYPE_SIGNAL, "interface": options["interface"], member: "Changed" }, function(message) {
+		//Decoding is part of what is being measured
+		message.arguments;
+		stats.received++;
+	});
+	subscribers.push(subscriber);
+}
+
+for (var i = 0; i < options.callers; ++i)
+	callers.push(connect(options.bus));
+
+if (callers.length > 0 && options["call-rate"] > 0) {
+	var calls = 0, callDue = 0;
+	setInterval(function() {
+		for (callDue += options["call-rate"] / 100; callDue >= 1; --callDue) {
+			var caller = callers[calls % callers.length],
+				message = dbus.methodCall(options.name, options.path+"/item"+(calls % options.objects), options["interface"], "Fetch"),
+				start = Date.now();
+			calls++;
+			caller.call(message, function(reply) {
+				if (reply.type === dbus.DBUS_MESSAGE_TYPE_ERROR)
+					stats.errors++;
+				else
+					reply.arguments;
+				stats.replies++;
+				stats.latency += Date.now() - start;
+				reply.dispose();
+			});
+		}
+	}, 10);
+}
+
+var started = Date.now(), last = started;
+
+setInterval(function() {
+	var now = Date.now(), seconds = (now - last) / 1000;
+	last = now;
+	console.log([
+		"t="+((now - started) / 1000).toFixed(1)+"s",
+		"signals/s="+(stats.signals / seconds).toFixed(0),
+		"stalled="+stats.stalled,
+		"received/s="+(stats.received / seconds).toFixed(0),
+		"calls/s="+(stats.calls / seconds).toFixed(0),
+		"replies/s="+(stats.replies / seconds).toFixed(0),
+		"errors="+stats.errors,
+		"latency(ms)="+(stats.replies ? stats.latency / stats.replies : 0).toFixed(2)
+	].join(" "));
+	if (options.profile)
+		console.log(DBus.profileReport(false, true));
+	Object.keys(stats).forEach(function(key) {
+		stats[key] = 0;
+	});
+}, options.report * 1000);
+
+if (options.duration > 0)
+	setTimeout(function() {
+		process.exit(0);
+	}, options.duration * 1000);
@@ -0,0 +1,143 @@
+
+/**
+ * Soak
+ * Pushes a long run of messages through the binding and reports RSS as
+ * it goes, to show that callbacks, batons and messages are released as
+ * fast as they are made. One private connection emits signals and
+ * calls, a second one receives the signals through a filter and answers
+ * the calls from an object path; every message is decoded and disposed.
+ *
+ *   node tools/soak.js --bus=session --messages=10000000 --report=100000
+ *
+ * RSS is sampled every --report messages. Growth is measured from the
+ * first sample after --warmup messages, and the exit status is 1 if it
+ * goes over --max-growth MB by the end. Every --call-every'th message is
+ * a method call instead of a signal.
+ */
+
+var
+	DBus = require('../dbus'),
+	dbus = require('../build/Release/dbus');
+
+var defaults = {
+	"bus": "session",
+	"messages": 10000000,
+	"report": 100000,
+	"warmup": 500000,
+	"max-growth": 32,
+	"call-every": 10,
+	"signature": "a{sv}",
+	"size": 4
+};
+
+var options = { };
+Object.keys(defaults).forEach(function(key) {
+	options[key] = defaults[key];
+});
+process.argv.slice(2).forEach(function(arg) {
+	var match = /^--([^=]+)=(.*)$/.exec(arg);
+	if (!match || !(match[1] in defaults))
+		throw new Error("Unknown argument "+arg);
+	options[match[1]] = typeof defaults[match[1]] === "number" ? Number(match[2]) : match[2];
+});
+
+function connect(bus) {
+	switch (bus) {
+	case "session": return new DBus(dbus.get(DBus.SESSION, true));
+	case "system": return new DBus(dbus.get(DBus.SYSTEM, true));
+	default: return new DBus(dbus.open(bus, true));
+	}
+}
+
+var
+	emitter = connect(options.bus),
+	receiver = connect(options.bus),
+	receiverName = "com.example.Soak",
+	path = "/com/example/Soak",
+	iface = "com.example.Soak",
+	values = { },
+	signal = dbus.signal(path, iface, "Tick"),
+	sent = 0, done = 0, backlogged = false,
+	baseline = 0, peak = 0, started = Date.now();
+
+for (var i = 0; i < options.size; ++i)
+	values["key"+i] = "value-"+i;
+
+signal.signature = options.signature;
+
+function mb(bytes) {
+	return (bytes / 1048576).toFixed(1);
+}
+
+function sample() {
+	var memory = process.memoryUsage();
+	if (done >= options.warmup && !baseline)
+		baseline = memory.rss;
+	peak = Math.max(peak, memory.rss);
+	console.log([
+		"messages="+done,
+		"rss="+mb(memory.rss)+"MB",
+		"heapUsed="+mb(memory.heapUsed)+"MB",
+		"growth="+(baseline ? mb(memory.rss - baseline) : "-")+"MB",
+		"rate="+(done / ((Date.now() - started) / 1000)).toFixed(0)+"/s"
+	].join(" "));
+}
+
+function finish() {
+	var growth = process.memoryUsage().rss - baseline;
+	sample();
+	console.log("peak="+mb(peak)+"MB growth since warmup="+mb(growth)+"MB");
+	process.exit(baseline && growth > options["max-growth"] * 1048576 ? 1 : 0);
+}
+
+function handled() {
+	if (++done % options.report === 0)
+		sample();
+	if (done >= options.messages)
+		finish();
+}
+
+if (receiver.requestName(receiverName, dbus.DBUS_NAME_FLAG_DO_NOT_QUEUE) !== dbus.DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+	throw new Error("Unable to own "+receiverName);
+
+receiver.addMatch("type='signal',interface='"+iface+"',member='Tick'");
+receiver.filter({ type: dbus.DBUS_MESSAGE_TYPE_SIGNAL, "interface": iface, member: "Tick" }, function(message) {
+	message.arguments;
+	handled();
+});
+receiver.backend.registerObjectPath(path, function(message) {
+	var reply = dbus.methodReturn(message);
+	reply.signature = options.signature;
+	reply.arguments = message.arguments;
+	message.dispose();
+	receiver.send(reply);
+});
+
+emitter.on("drain", function() {
+	backlogged = false;
+	pump();
+});
+
+function pump() {
+	while (!backlogged && sent < options.messages) {
+		if (++sent % options["call-every"] === 0) {
+			var call = dbus.methodCall(receiverName, path, iface, "Echo");
+			call.signature = options.signature;
+			call.arguments = [ values ];
+			emitter.call(call, function(reply) {
+				reply.arguments;
+				reply.dispose();
+				handled();
+			});
+		}
+		else {
+			signal.fill([ values ]);
+			backlogged = !emitter.send(signal);
+		}
+		//Give the receiver a turn now and then
+		if (sent % 1000 === 0)
+			return setTimeout(pump, 0);
+	}
+}
+
+pump();
@@ -24,7 +24,10 @@ if (args.Length() <= (I) || !args[I]->IsObject())                     \
 if (args.Length() <= (I) || !args[I]->IsObject())                     \
     return ThrowException(Exception::TypeError(                         \
                   String::New("Argument " #I " must be an object")));   \
-	DBusMessageWrap *VAR = ObjectWrap::Unwrap<DBusMessageWrap>(Local<Object>::Cast(args[I]));
+	DBusMessageWrap *VAR = ObjectWrap::Unwrap<DBusMessageWrap>(Local<Object>::Cast(args[I])); \
+  if (VAR->message == NULL)                                             \
+    return ThrowException(Exception::Error(                             \
+                  String::New("Argument " #I " has been disposed")));
 
 
 #define OPT_STR_ARG(I, VAR, DEFAULT)                                    \
@@ -113,5 +116,11 @@ if (args.Length() <= (I) || !args[I]->IsObject())                     \
 
 #define THIS_CONNECTION(args) ObjectWrap::Unwrap<DBusConnectionWrap>(args.This())
 
+#define REQ_OPEN_CONNECTION(VAR, args)                                  \
+  DBusConnectionWrap* VAR = THIS_CONNECTION(args);                      \
+  if (!VAR->connection)                                                 \
+    return ThrowException(Exception::Error(                             \
+                  String::New("Connection has been closed")));
+
 #define THIS_MESSAGE(args) ObjectWrap::Unwrap<DBusMessageWrap>(args.This())
 